@@ -0,0 +1,360 @@
+/*
+ * Micro-benchmarks for the checksum and superblock code
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE 600
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+#define MIN_SIZE	64
+#define MAX_SIZE	(64 << 20)
+
+static unsigned reps = 5;
+static unsigned warmup_ms = 50;
+static unsigned min_rep_ms = 20;
+static size_t max_size = MAX_SIZE;
+static bool quiet;
+
+/* results are summed in here so the compiler can't drop the work */
+static volatile uint64_t sink;
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: bcache-bench [options]\n"
+		"	-r reps		timed repetitions per case (default 5)\n"
+		"	-w ms		warmup time per case (default 50)\n"
+		"	-t ms		minimum time per repetition (default 20)\n"
+		"	-m size		largest buffer size (default 64M)\n"
+		"	-q		only print machine readable lines\n"
+		"	-c		check the crc64 implementations against\n"
+		"			each other instead of benchmarking\n"
+		"	-s seed		random seed for -c (default: pid)\n"
+		"	-h		display this help and exit\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef uint64_t (*bench_fn)(const void *arg, const void *buf, size_t len);
+
+static uint64_t run(bench_fn fn, const void *arg, const void *buf,
+		    size_t len, uint64_t iters)
+{
+	uint64_t i, start = now_ns(), acc = 0;
+
+	for (i = 0; i < iters; i++)
+		acc += fn(arg, buf, len);
+
+	sink += acc;
+	return now_ns() - start;
+}
+
+static int cmp_double(const void *_l, const void *_r)
+{
+	double l = *(const double *) _l, r = *(const double *) _r;
+
+	return (l > r) - (l < r);
+}
+
+/*
+ * Warm up, then pick an iteration count that makes one repetition last at
+ * least min_rep_ms, and report the median of the repetitions.  Throughput is
+ * over @bytes, the bytes one call actually processes, and isn't reported if
+ * that's 0 (the work isn't proportional to any one size).
+ */
+static void bench(const char *name, bench_fn fn, const void *arg,
+		  const void *buf, size_t len, size_t bytes)
+{
+	double ns_op[reps], median, gbps;
+	uint64_t iters = 1, elapsed = 0;
+	unsigned i;
+
+	while (elapsed < warmup_ms * 1000000ULL) {
+		elapsed += run(fn, arg, buf, len, iters);
+		iters *= 2;
+	}
+
+	iters = 1;
+	while (run(fn, arg, buf, len, iters) < min_rep_ms * 1000000ULL)
+		iters *= 2;
+
+	for (i = 0; i < reps; i++)
+		ns_op[i] = (double) run(fn, arg, buf, len, iters) / iters;
+
+	qsort(ns_op, reps, sizeof(double), cmp_double);
+	median = ns_op[reps / 2];
+	gbps = bytes / median;
+
+	if (!quiet && bytes)
+		printf("%-20s %10zu %14.1f %10.3f\n", name, bytes, median, gbps);
+	else if (!quiet)
+		printf("%-20s %10zu %14.1f %10s\n", name, len, median, "-");
+
+	printf("BENCH name=%s size=%zu iters=%" PRIu64 " reps=%u"
+	       " ns_per_op=%.1f min_ns_per_op=%.1f",
+	       name, bytes ?: len, iters, reps, median, ns_op[0]);
+	if (bytes)
+		printf(" gb_per_s=%.3f", gbps);
+	putchar('\n');
+	fflush(stdout);
+}
+
+static uint64_t bench_crc64_impl(const void *arg, const void *buf, size_t len)
+{
+	const struct crc64_impl *impl = arg;
+
+	return impl->update(crc64_init(), buf, len);
+}
+
+static uint64_t bench_crc64(const void *arg, const void *buf, size_t len)
+{
+	return crc64(buf, len);
+}
+
+static uint64_t bench_csum_set(const void *arg, const void *buf, size_t len)
+{
+	return csum_set((const struct cache_sb *) buf);
+}
+
+/* What bcache-super-show does with a superblock it has read */
+static uint64_t bench_sb_parse(const void *arg, const void *buf, size_t len)
+{
+	struct cache_sb_info info;
+	struct cache_sb sb;
+
+	memcpy(&sb, buf + SB_START, sizeof(sb));
+	cache_sb_decode(&sb, &info);
+
+	if (!info.magic_ok || !info.offset_ok || !info.csum_ok ||
+	    !info.version)
+		return 0;
+
+	return info.bdev ? info.first_sector : info.total_sectors;
+}
+
+#define CHECK_MAX	4096
+#define CHECK_ROUNDS	8
+#define CHECK_IMPLS	16
+
+static unsigned check_seed, check_failed;
+
+static void check_result(const char *name, uint64_t got, uint64_t want,
+			 size_t len, size_t off, unsigned *failed)
+{
+	if (got == want)
+		return;
+
+	if (!*failed)
+		fprintf(stderr, "%s: wrong result for %zu bytes at offset "
+			"%zu (seed %u)\n", name, len, off, check_seed);
+	++*failed;
+	check_failed++;
+}
+
+/*
+ * Cross-check every crc64 implementation this cpu supports against the
+ * bytewise reference, on fresh random data each round: every length from 0
+ * to CHECK_MAX, each at a random misalignment.  Also checks crc64(), which
+ * dispatches to the fastest one, and crc64_update() split at a random point.
+ * Returns the number of mismatches.
+ */
+static unsigned check_crc64(unsigned rounds, bool verbose)
+{
+	const struct crc64_impl *impl, *ref = &crc64_impls[0];
+	unsigned failed[CHECK_IMPLS] = { 0 }, dispatch_failed = 0;
+	unsigned split_failed = 0;
+	char names[CHECK_IMPLS][32];
+	unsigned char *buf;
+	unsigned round, n;
+	size_t i, len, off, split;
+	uint64_t want, crc;
+
+	if (posix_memalign((void **) &buf, 64, CHECK_MAX + 64)) {
+		fprintf(stderr, "Could not allocate check buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (impl = crc64_impls, n = 0; impl->name && n < CHECK_IMPLS; impl++, n++)
+		snprintf(names[n], sizeof(names[n]), "crc64/%s", impl->name);
+
+	srandom(check_seed);
+	check_failed = 0;
+
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < CHECK_MAX + 64; i++)
+			buf[i] = random();
+
+		for (len = 0; len <= CHECK_MAX; len++) {
+			off = random() % 64;
+			want = ref->update(crc64_init(), buf + off, len);
+
+			for (impl = crc64_impls + 1, n = 1;
+			     impl->name && n < CHECK_IMPLS; impl++, n++)
+				if (impl->supported())
+					check_result(names[n],
+						impl->update(crc64_init(),
+							     buf + off, len),
+						want, len, off, &failed[n]);
+
+			check_result("crc64", crc64(buf + off, len),
+				     crc64_final(want), len, off,
+				     &dispatch_failed);
+
+			split = random() % (len + 1);
+			crc = crc64_update(crc64_init(), buf + off, split);
+			crc = crc64_update(crc, buf + off + split, len - split);
+			check_result("crc64_update split", crc, want, len, off,
+				     &split_failed);
+		}
+	}
+
+	if (verbose) {
+		for (impl = crc64_impls, n = 0;
+		     impl->name && n < CHECK_IMPLS; impl++, n++)
+			if (!impl->supported())
+				printf("%-16s not supported on this cpu\n",
+				       names[n]);
+			else if (n)
+				printf("%-16s %s\n", names[n],
+				       failed[n] ? "FAILED" : "ok");
+		printf("%-16s %s\n%-16s %s\n",
+		       "crc64",
+		       dispatch_failed ? "FAILED" : "ok", "crc64_update",
+		       split_failed ? "FAILED" : "ok");
+		printf("%u rounds of 0 to %u bytes, seed %u: %u mismatches\n",
+		       rounds, CHECK_MAX, check_seed, check_failed);
+	}
+
+	free(buf);
+	return check_failed;
+}
+
+static void init_sb(struct cache_sb *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->offset	= SB_SECTOR;
+	sb->version	= BCACHE_SB_VERSION_CDEV;
+	memcpy(sb->magic, bcache_magic, 16);
+	sb->block_size	= 8;
+	sb->bucket_size	= 1024;
+	sb->nbuckets	= 1 << 20;
+	sb->nr_in_set	= 1;
+	sb->first_bucket = 1;
+	sb->csum	= csum_set(sb);
+}
+
+int main(int argc, char **argv)
+{
+	const struct crc64_impl *impl;
+	unsigned char *buf;
+	struct cache_sb *sb, *sb_data;
+	bool check = false, seeded = false;
+	size_t i, len;
+	char name[64];
+	int o;
+
+	while ((o = getopt(argc, argv, "r:w:t:m:qcs:h")) != EOF)
+		switch (o) {
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'w':
+			warmup_ms = atoi(optarg);
+			break;
+		case 't':
+			min_rep_ms = atoi(optarg);
+			break;
+		case 'm':
+			max_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'c':
+			check = true;
+			break;
+		case 's':
+			check_seed = strtoul(optarg, NULL, 0);
+			seeded = true;
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+
+	if (!reps || max_size < MIN_SIZE) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!seeded)
+		check_seed = getpid();
+
+	if (check)
+		return check_crc64(CHECK_ROUNDS, true)
+			? EXIT_FAILURE : EXIT_SUCCESS;
+
+	/* don't time an implementation that gives wrong answers */
+	if (check_crc64(1, false))
+		exit(EXIT_FAILURE);
+
+	if (posix_memalign((void **) &buf, 4096, max_size)) {
+		fprintf(stderr, "Could not allocate %zu byte buffer\n",
+			max_size);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < max_size; i++)
+		buf[i] = random();
+
+	if (!quiet)
+		printf("%-20s %10s %14s %10s\n",
+		       "case", "bytes", "ns/op", "GB/s");
+
+	for (len = MIN_SIZE; len <= max_size; len *= 4) {
+		for (impl = crc64_impls; impl->name; impl++) {
+			if (!impl->supported())
+				continue;
+
+			snprintf(name, sizeof(name), "crc64/%s", impl->name);
+			bench(name, bench_crc64_impl, impl, buf, len, len);
+		}
+
+		bench("crc64", bench_crc64, NULL, buf, len, len);
+	}
+
+	if (posix_memalign((void **) &sb, 4096, SB_START + sizeof(*sb))) {
+		fprintf(stderr, "Could not allocate superblock buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* csum_set() covers from after the csum to the end of d[keys] */
+	sb_data = (void *) sb + SB_START;
+	init_sb(sb_data);
+	bench("csum_set", bench_csum_set, NULL, sb_data, sizeof(*sb),
+	      end(sb_data) - (void *) sb_data - 8);
+	bench("sb_parse", bench_sb_parse, NULL, sb, SB_START + sizeof(*sb), 0);
+
+	return 0;
+}
@@ -4,34 +4,389 @@
  * GPLv2
  */
 
+#define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/wait.h>
+#include <uuid/uuid.h>
 
-int main(int argc, char *argv[])
+#include "bcache.h"
+
+/*
+ * With one device this is the old bcache-register: write it to sysfs and
+ * wait.  With several, devices are grouped by the cache set uuid in their
+ * superblock; within a set cache devices are registered before backing
+ * devices (so the backing devices attach as soon as they show up), and
+ * independent sets are registered concurrently.
+ *
+ * The kernel can take a long time over a single device (journal replay),
+ * and the write can't be interrupted; each registration runs in a child
+ * process so that on timeout we can report it and move on, leaving the
+ * kernel to finish in the background.
+ */
+
+struct reg_dev
+{
+    const char  *path;
+    unsigned    idx;
+    bool        valid;      /* superblock read and checked out */
+    bool        cache;
+    uuid_t      set_uuid;
+
+    int         ret;
+    bool        timed_out;
+    uint64_t    ns;
+};
+
+struct reg_queue
+{
+    struct reg_dev  **devs;
+    unsigned        *sets;  /* index of each set's first device */
+    unsigned        nr_sets;
+    unsigned        next;
+};
+
+static const char *sysfs = BCACHE_REGISTER_PATH;
+static unsigned timeout_ms;
+static bool quiet;
+
+static void usage()
 {
+    fprintf(stderr,
+            "Usage: bcache-register [options] device...\n"
+            "	-s, --sysfs path	register through path instead of\n"
+            "				" BCACHE_REGISTER_PATH "\n"
+            "	-t, --timeout secs	stop waiting for a device after secs\n"
+            "	-j, --jobs N		register up to N cache sets at once\n"
+            "	-q, --quiet		don't print per device timings\n"
+            "	-h, --help		display this help and exit\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_sb(struct reg_dev *d)
+{
+    struct cache_sb sb;
     int fd;
 
-    if (argc != 2)
+    fd = open(d->path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if (pread(fd, &sb, sizeof(sb), SB_START) == sizeof(sb) &&
+        cache_sb_valid(&sb))
+    {
+        d->valid = true;
+        d->cache = !SB_IS_BDEV(&sb);
+        uuid_copy(d->set_uuid, sb.set_uuid);
+    }
+
+    close(fd);
+}
+
+/* by set, caches first, otherwise in command line order */
+static int cmp_dev(const void *_l, const void *_r)
+{
+    const struct reg_dev *l = *(struct reg_dev * const *) _l;
+    const struct reg_dev *r = *(struct reg_dev * const *) _r;
+    int c;
+
+    if (l->valid != r->valid)
+        return r->valid - l->valid;
+    if (l->valid)
+    {
+        if ((c = uuid_compare(l->set_uuid, r->set_uuid)))
+            return c;
+        if (l->cache != r->cache)
+            return r->cache - l->cache;
+    }
+    return (l->idx > r->idx) - (l->idx < r->idx);
+}
+
+static void register_dev(struct reg_dev *d)
+{
+    uint64_t start = now_ns();
+    char line[PATH_MAX + 1];
+    struct pollfd pfd;
+    int p[2], r, len, ret = -EIO;
+    pid_t pid;
+
+    if (!timeout_ms)
+    {
+        d->ret = bcache_register(sysfs, d->path);
+        d->ns = now_ns() - start;
+        return;
+    }
+
+    /*
+     * We're threaded: between fork() and _exit() the child may only make
+     * async-signal-safe calls (no stdio, whose locks another thread may
+     * hold), so the line is formatted up front.
+     */
+    len = snprintf(line, sizeof(line), "%s\n", d->path);
+    if (len >= sizeof(line))
+    {
+        d->ret = -ENAMETOOLONG;
+        return;
+    }
+
+    if (pipe2(p, O_CLOEXEC) < 0)
+    {
+        d->ret = -errno;
+        return;
+    }
+
+    pid = fork();
+    if (pid < 0)
+    {
+        d->ret = -errno;
+        close(p[0]);
+        close(p[1]);
+        return;
+    }
+
+    if (!pid)
+    {
+        /* don't hold udev's output pipes open if we outlive our parent */
+        r = open("/dev/null", O_RDWR);
+        if (r >= 0)
+        {
+            dup2(r, STDOUT_FILENO);
+            dup2(r, STDERR_FILENO);
+        }
+
+        ret = bcache_register_line(sysfs, line, len);
+        if (write(p[1], &ret, sizeof(ret)) != sizeof(ret))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(p[1]);
+
+    pfd.fd = p[0];
+    pfd.events = POLLIN;
+    do
+        r = poll(&pfd, 1, timeout_ms);
+    while (r < 0 && errno == EINTR);
+
+    if (r > 0)
+    {
+        if (read(p[0], &ret, sizeof(ret)) != sizeof(ret))
+            ret = -EIO;
+        waitpid(pid, NULL, 0);
+    }
+    else
+    {
+        /* the child finishes (and gets reaped) without us */
+        d->timed_out = true;
+        ret = -ETIMEDOUT;
+    }
+
+    close(p[0]);
+    d->ret = ret;
+    d->ns = now_ns() - start;
+}
+
+static void report(const struct reg_dev *d)
+{
+    char what[80] = "no bcache superblock";
+    char uuid[40];
+
+    if (d->valid)
     {
-        fprintf(stderr, "bcache-register takes exactly one argument\n");
+        uuid_unparse(d->set_uuid, uuid);
+        snprintf(what, sizeof(what), "%s device of set %s",
+                 d->cache ? "cache" : "backing", uuid);
+    }
+
+    if (d->timed_out)
+        fprintf(stderr, "%s: still registering after %u.%03us, "
+                "left to finish in the background\n",
+                d->path, timeout_ms / 1000, timeout_ms % 1000);
+    else if (d->ret)
+        fprintf(stderr, "Error registering %s with bcache: %s\n",
+                d->path, strerror(-d->ret));
+
+    if (!quiet)
+        printf("%s: %s, %s after %.1f ms\n", d->path, what,
+               d->timed_out ? "timed out" :
+               d->ret ? "failed" : "registered", d->ns / 1e6);
+}
+
+static void *register_worker(void *arg)
+{
+    struct reg_queue *q = arg;
+    unsigned s, i;
+
+    while ((s = __sync_fetch_and_add(&q->next, 1)) < q->nr_sets)
+        for (i = q->sets[s]; i < q->sets[s + 1]; i++)
+        {
+            register_dev(q->devs[i]);
+            flockfile(stdout);
+            report(q->devs[i]);
+            fflush(stdout);
+            funlockfile(stdout);
+        }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct reg_queue q = { 0 };
+    struct reg_dev *devs;
+    pthread_t *threads;
+    unsigned i, nr, nr_threads = 0, failed = 0;
+    char *end;
+    double t;
+    int c;
+
+    struct option opts[] = {
+        { "sysfs",      1, NULL,    's' },
+        { "timeout",    1, NULL,    't' },
+        { "jobs",       1, NULL,    'j' },
+        { "quiet",      0, NULL,    'q' },
+        { "help",       0, NULL,    'h' },
+        { NULL,         0, NULL,    0 },
+    };
+
+    while ((c = getopt_long(argc, argv, "s:t:j:qh", opts, NULL)) != -1)
+        switch (c)
+        {
+        case 's':
+            sysfs = optarg;
+            break;
+        case 't':
+            t = strtod(optarg, &end);
+            /* written so that NaN fails too */
+            if (end == optarg || *end || !(t > 0 && t <= 86400))
+            {
+                fprintf(stderr, "Bad timeout %s\n", optarg);
+                return 1;
+            }
+            /* round up, so any positive timeout is at least 1ms */
+            timeout_ms = t * 1000;
+            if (timeout_ms < t * 1000)
+                timeout_ms++;
+            break;
+        case 'j':
+            nr_threads = strtoul(optarg, &end, 10);
+            if (*end || !nr_threads)
+            {
+                fprintf(stderr, "Bad number of jobs %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+
+    nr = argc - optind;
+    if (!nr)
+    {
+        usage();
         return 1;
     }
 
-    fd = open("/sys/fs/bcache/register", O_WRONLY);
-    if (fd < 0)
+    if (access(sysfs, W_OK))
     {
-        perror("Error opening /sys/fs/bcache/register");
-        fprintf(stderr, "The bcache kernel module must be loaded\n");
+        fprintf(stderr, "Error opening %s: %m\n", sysfs);
+        if (errno == ENOENT)
+            fprintf(stderr, "The bcache kernel module must be loaded\n");
         return 1;
     }
 
-    if (dprintf(fd, "%s\n", argv[1]) < 0)
+    /* the old interface: one device, no output unless it fails */
+    if (nr == 1 && !timeout_ms)
+    {
+        int ret = bcache_register(sysfs, argv[optind]);
+
+        if (ret)
+        {
+            fprintf(stderr, "Error registering %s with bcache: %s\n",
+                    argv[optind], strerror(-ret));
+            return 1;
+        }
+        return 0;
+    }
+
+    devs = calloc(nr, sizeof(*devs));
+    q.devs = calloc(nr, sizeof(*q.devs));
+    q.sets = calloc(nr + 1, sizeof(*q.sets));
+    if (!devs || !q.devs || !q.sets)
     {
-        fprintf(stderr, "Error registering %s with bcache: %m\n", argv[1]);
+        fprintf(stderr, "Out of memory\n");
         return 1;
     }
 
-    return 0;
-}
+    for (i = 0; i < nr; i++)
+    {
+        devs[i].path = argv[optind + i];
+        devs[i].idx = i;
+        read_sb(&devs[i]);
+        q.devs[i] = &devs[i];
+    }
 
+    qsort(q.devs, nr, sizeof(*q.devs), cmp_dev);
+
+    /* devices we couldn't read go to the kernel one by one */
+    for (i = 0; i < nr; i++)
+        if (!i || !q.devs[i]->valid ||
+            uuid_compare(q.devs[i]->set_uuid, q.devs[i - 1]->set_uuid))
+            q.sets[q.nr_sets++] = i;
+    q.sets[q.nr_sets] = nr;
+
+    if (!nr_threads || nr_threads > q.nr_sets)
+        nr_threads = q.nr_sets;
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!threads)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, register_worker, &q))
+        {
+            fprintf(stderr, "Could not start worker thread\n");
+            return 1;
+        }
+
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < nr; i++)
+        failed += devs[i].ret != 0;
+
+    if (!quiet && nr > 1)
+        printf("%u of %u devices registered\n", nr - failed, nr);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Change the tunables in a bcache superblock without reformatting
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define __USE_FILE_OFFSET64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+/*
+ * The superblock lives in the 4k block at SB_START; we read and write that
+ * whole block with O_DIRECT, so the new superblock goes out in a single
+ * aligned write and O_DSYNC makes it a FUA write (or a write plus flush)
+ */
+#define SB_BLOCK	4096
+
+static const char * const cache_replacement_policies[] = {
+	"lru",
+	"fifo",
+	"random",
+	NULL
+};
+
+static const char * const cache_modes[] = {
+	"writethrough",
+	"writeback",
+	"writearound",
+	"none",
+	NULL
+};
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: bcache-super-edit [options] device\n"
+		"	    --cache-mode mode	 backing devices: writethrough, writeback,\n"
+		"				 writearound or none\n"
+		"	    --cache_replacement_policy=(lru|fifo|random)\n"
+		"				 cache devices\n"
+		"	    --discard		 cache devices: enable discards\n"
+		"	    --no-discard	 cache devices: disable discards\n"
+		"	-l, --label label	 set the label (up to %u bytes)\n"
+		"	-n, --dry-run		 show the changes, don't write them\n"
+		"	-h, --help		 display this help and exit\n",
+		SB_LABEL_SIZE);
+}
+
+static int read_list(const char *s, const char * const list[])
+{
+	int i;
+
+	for (i = 0; list[i]; i++)
+		if (!strcmp(list[i], s))
+			return i;
+	return -1;
+}
+
+/* The kernel holds registered devices open exclusively, but files aren't */
+static bool registered(int fd, const char *dev)
+{
+	char path[64];
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Can't stat %s: %m\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!S_ISBLK(st.st_mode))
+		return false;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/bcache",
+		 major(st.st_rdev), minor(st.st_rdev));
+	return !access(path, F_OK);
+}
+
+static void show_change(const char *field, const char *old, const char *new)
+{
+	if (!*old)
+		old = "(empty)";
+	if (!*new)
+		new = "(empty)";
+
+	if (strcmp(old, new))
+		printf("%-20s%s -> %s\n", field, old, new);
+	else
+		printf("%-20s%s (unchanged)\n", field, old);
+}
+
+int main(int argc, char **argv)
+{
+	int c, fd, cache_mode = -1, replacement = -1, discard = -1;
+	bool dry_run = false;
+	const char *label = NULL;
+	char old_label[SB_LABEL_SIZE + 1], new_label[SB_LABEL_SIZE + 1];
+	struct cache_sb *sb;
+	void *buf;
+
+	struct option opts[] = {
+		{ "cache-mode",		1, NULL,	'm' },
+		{ "cache_mode",		1, NULL,	'm' },
+		{ "cache_replacement_policy", 1, NULL, 'p' },
+		{ "cache-replacement-policy", 1, NULL, 'p' },
+		{ "discard",		0, &discard,	1 },
+		{ "no-discard",		0, &discard,	0 },
+		{ "label",		1, NULL,	'l' },
+		{ "dry-run",		0, NULL,	'n' },
+		{ "help",		0, NULL,	'h' },
+		{ NULL,			0, NULL,	0 },
+	};
+
+	while ((c = getopt_long(argc, argv, "l:nh", opts, NULL)) != -1)
+		switch (c) {
+		case 'm':
+			if ((cache_mode = read_list(optarg, cache_modes)) < 0) {
+				fprintf(stderr, "Bad cache mode %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			replacement = read_list(optarg,
+						cache_replacement_policies);
+			if (replacement < 0) {
+				fprintf(stderr, "Bad replacement policy %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			if (strlen(optarg) > SB_LABEL_SIZE) {
+				fprintf(stderr, "Label is longer than %u bytes\n",
+					SB_LABEL_SIZE);
+				exit(EXIT_FAILURE);
+			}
+			label = optarg;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		case 0:
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+
+	if (argc - optind != 1 ||
+	    (cache_mode < 0 && replacement < 0 && discard < 0 && !label)) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[optind], (dry_run ? O_RDONLY : O_RDWR|O_DSYNC)|
+		  O_EXCL|O_DIRECT);
+	if (fd < 0 && errno == EINVAL)
+		/* files on filesystems without O_DIRECT, e.g. tmpfs */
+		fd = open(argv[optind], (dry_run ? O_RDONLY : O_RDWR|O_DSYNC)|
+			  O_EXCL);
+	if (fd < 0) {
+		if (errno == EBUSY)
+			fprintf(stderr, "%s is in use (registered with bcache or "
+				"mounted); refusing to edit it\n", argv[optind]);
+		else
+			fprintf(stderr, "Can't open %s: %m\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (registered(fd, argv[optind])) {
+		fprintf(stderr, "%s is registered with bcache; "
+			"refusing to edit it\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (posix_memalign(&buf, SB_BLOCK, SB_BLOCK)) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	sb = buf;
+
+	if (pread(fd, buf, SB_BLOCK, SB_START) != SB_BLOCK) {
+		fprintf(stderr, "Couldn't read superblock from %s\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!cache_sb_valid(sb)) {
+		fprintf(stderr, "%s doesn't have a valid bcache superblock\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sb->version > BCACHE_SB_MAX_VERSION) {
+		fprintf(stderr, "Unknown superblock version %" PRIu64 "\n",
+			sb->version);
+		exit(EXIT_FAILURE);
+	}
+
+	if (SB_IS_BDEV(sb) && (replacement >= 0 || discard >= 0)) {
+		fprintf(stderr, "%s is a backing device; the replacement policy "
+			"and discard belong to the cache device\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!SB_IS_BDEV(sb) && cache_mode >= 0) {
+		fprintf(stderr, "%s is a cache device; the cache mode belongs "
+			"to the backing device\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cache_mode >= 0) {
+		show_change("cache mode",
+			    BDEV_CACHE_MODE(sb) < 4 ?
+			    cache_modes[BDEV_CACHE_MODE(sb)] : "unknown",
+			    cache_modes[cache_mode]);
+		SET_BDEV_CACHE_MODE(sb, cache_mode);
+	}
+
+	if (replacement >= 0) {
+		show_change("replacement policy",
+			    CACHE_REPLACEMENT(sb) < 3 ?
+			    cache_replacement_policies[CACHE_REPLACEMENT(sb)] :
+			    "unknown",
+			    cache_replacement_policies[replacement]);
+		SET_CACHE_REPLACEMENT(sb, replacement);
+	}
+
+	if (discard >= 0) {
+		show_change("discard", CACHE_DISCARD(sb) ? "yes" : "no",
+			    discard ? "yes" : "no");
+		SET_CACHE_DISCARD(sb, discard);
+	}
+
+	if (label) {
+		memcpy(old_label, sb->label, SB_LABEL_SIZE);
+		old_label[SB_LABEL_SIZE] = '\0';
+		memset(new_label, 0, sizeof(new_label));
+		memcpy(new_label, label, strlen(label));
+
+		show_change("label", old_label, new_label);
+		memcpy(sb->label, new_label, SB_LABEL_SIZE);
+	}
+
+	sb->csum = csum_set(sb);
+
+	if (dry_run) {
+		printf("Dry run, %s not changed\n", argv[optind]);
+		return 0;
+	}
+
+	if (pwrite(fd, buf, SB_BLOCK, SB_START) != SB_BLOCK) {
+		fprintf(stderr, "Error writing superblock to %s: %m\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* read it back from the device, not from our buffer */
+	memset(buf, 0, SB_BLOCK);
+	if (pread(fd, buf, SB_BLOCK, SB_START) != SB_BLOCK ||
+	    !cache_sb_valid(sb)) {
+		fprintf(stderr, "Superblock on %s didn't read back correctly\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -8,28 +8,117 @@
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <inttypes.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "bcache.h"
+#include "uring.h"
+
+#define SHOW_THREADS	32
+
+/* scan mode: this many reads of this size in flight */
+#define SCAN_CHUNK	(4U << 20)
+#define SCAN_QD		4
+
+enum output {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_NDJSON,
+};
 
+/*
+ * The members of a cache set, as far as the valid cache superblocks we were
+ * shown tell: each says how many caches the set has (nr_in_set) and which
+ * one it is (nr_this_dev), and they all have to share the bucket geometry.
+ */
+enum cset_problem {
+	CSET_NR_IN_SET		= 1 << 0,
+	CSET_DUPLICATE		= 1 << 1,
+	CSET_OUT_OF_RANGE	= 1 << 2,
+	CSET_GEOMETRY		= 1 << 3,
+};
+
+static const char * const cset_problems[] = {
+	"members disagree on nr_in_set",
+	"two members with the same nr_this_dev",
+	"nr_in_set or nr_this_dev out of range",
+	"members disagree on block or bucket size",
+	NULL
+};
+
+struct cset {
+	uuid_t			uuid;
+	unsigned		nr_in_set;	/* as the first member says */
+	unsigned		seen;
+	uint64_t		members;	/* bitmap of nr_this_dev */
+	unsigned		block_size;
+	uint64_t		bucket_size;
+	unsigned		problems;
+};
+
+struct show {
+	const char		*dev;
+	int			err;	/* errno from open or read */
+	bool			opened;
+	/* found by scanning; the bcache device starts this far in */
+	bool			scanned;
+	uint64_t		start;
+	struct cache_sb		sb;
+	struct cache_sb_info	info;
+	struct cset		*cset;	/* valid cache devices only */
+};
+
+struct scan {
+	const char		*dev;
+	int			fd;	/* O_DIRECT if we can */
+	int			sb_fd;
+	uint64_t		size;
+	uint64_t		matches;
+	struct show		*hits;
+	unsigned		nr_hits;
+};
+
+struct show_queue {
+	struct show		*devs;
+	unsigned		nr;
+	unsigned		next;
+};
 
 static void usage()
 {
-	fprintf(stderr, "Usage: bcache-super-show [-f] <device>\n");
+	fprintf(stderr,
+		"Usage: bcache-super-show [-fs] [-o text|json|ndjson] [-j threads] <device>...\n"
+		"	-f		keep going if the superblock crc is invalid\n"
+		"	-o format	text (default), a json array, or one json\n"
+		"			object per line\n"
+		"	-j threads	read up to this many superblocks at once (default %u)\n"
+		"	-s		scan the whole device for superblocks that\n"
+		"			aren't at the start\n"
+		"Devices may be glob patterns, e.g. '/dev/disk/by-id/*'\n",
+		SHOW_THREADS);
 }
 
 
@@ -56,202 +145,828 @@ static void print_encode(char* in)
 }
 
 
-int main(int argc, char **argv)
+static void read_sb(struct show *s)
 {
-	bool force_csum = false;
-	int o;
-	extern char *optarg;
+	int fd = open(s->dev, O_RDONLY);
+
+	if (fd < 0) {
+		s->err = errno;
+		return;
+	}
+
+	s->opened = true;
+	errno = 0;
+	if (pread(fd, &s->sb, sizeof(s->sb), SB_START) != sizeof(s->sb))
+		s->err = errno ?: EIO;
+	else
+		cache_sb_decode(&s->sb, &s->info);
+
+	close(fd);
+}
+
+static void *show_worker(void *arg)
+{
+	struct show_queue *q = arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add(&q->next, 1)) < q->nr)
+		read_sb(&q->devs[i]);
+
+	return NULL;
+}
+
+/*
+ * Scan mode, for superblocks that aren't where they should be because a
+ * partition table was rewritten or a raid/lvm layer shifted things.  Every
+ * superblock starts on a sector boundary, so we stream the device through
+ * a few large O_DIRECT reads kept in flight and look for the magic at the
+ * right place in each sector; the rare matches are reread and checked,
+ * and the superblock's offset tells us where its device started.
+ */
+static void scan_match(struct scan *s, uint64_t pos)
+{
+	struct show *hit;
 	struct cache_sb sb;
-	char uuid[40];
-	uint64_t expected_csum;
 
-	while ((o = getopt(argc, argv, "f")) != EOF)
-		switch (o) {
-			case 'f':
-				force_csum = 1;
-				break;
+	s->matches++;
 
-			default:
-				usage();
-				exit(1);
+	if (pos < SB_START ||
+	    pread(s->sb_fd, &sb, sizeof(sb), pos) != sizeof(sb) ||
+	    !cache_sb_valid(&sb))
+		return;
+
+	hit = realloc(s->hits, (s->nr_hits + 1) * sizeof(*hit));
+	if (!hit) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	s->hits = hit;
+
+	hit = &s->hits[s->nr_hits++];
+	memset(hit, 0, sizeof(*hit));
+	hit->dev	= s->dev;
+	hit->opened	= true;
+	hit->scanned	= true;
+	hit->start	= pos - sb.offset * 512;
+	hit->sb		= sb;
+	cache_sb_decode(&hit->sb, &hit->info);
+}
+
+static void scan_buf(struct scan *s, const unsigned char *buf, size_t len,
+		     uint64_t pos)
+{
+	const size_t magic = offsetof(struct cache_sb, magic);
+	size_t i;
+#ifdef __SSE2__
+	const __m128i m = _mm_loadu_si128((const __m128i *) bcache_magic);
+
+	for (i = 0; i + 512 <= len; i += 512) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i + magic));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, m)) == 0xFFFF)
+			scan_match(s, pos + i);
+	}
+#else
+	for (i = 0; i + 512 <= len; i += 512)
+		if (!memcmp(buf + i + magic, bcache_magic, 16))
+			scan_match(s, pos + i);
+#endif
+}
+
+static int scan_sync(struct scan *s, unsigned char *buf)
+{
+	uint64_t pos = 0;
+	ssize_t ret;
+
+	while (pos < s->size) {
+		ret = pread(s->fd, buf, SCAN_CHUNK, pos);
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			break;
+
+		/* a short read could end mid-sector; pick that sector up next time */
+		ret &= ~511;
+		if (!ret)
+			break;
+
+		scan_buf(s, buf, ret, pos);
+		pos += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Keep SCAN_QD chunks in flight; they complete in any order, and the hits
+ * get sorted afterwards.  Returns -ENOSYS and the like if io_uring isn't
+ * available, so the caller can fall back to scan_sync().
+ */
+static int scan_uring(struct scan *s, unsigned char *bufs)
+{
+	struct iovec iov[SCAN_QD];
+	uint64_t pos[SCAN_QD], next = 0;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned i, inflight = 0;
+	struct uring ring;
+	int ret = 0, res;
+
+	if ((ret = uring_init(&ring, SCAN_QD)))
+		return ret;
+
+	for (i = 0; i < SCAN_QD && next < s->size; i++) {
+		pos[i] = next;
+		iov[i].iov_base = bufs + (size_t) i * SCAN_CHUNK;
+		iov[i].iov_len = SCAN_CHUNK;
+		next += SCAN_CHUNK;
+
+		sqe = uring_get_sqe(&ring);
+		uring_prep_rw(sqe, IORING_OP_READV, s->fd, &iov[i], 1,
+			      pos[i], i);
+		inflight++;
+	}
+
+	while (inflight) {
+		res = uring_submit(&ring, 1);
+		if (res < 0) {
+			ret = res;
+			break;
 		}
 
-	argv += optind;
-	argc -= optind;
+		while ((cqe = uring_peek_cqe(&ring))) {
+			i = cqe->user_data;
+			res = cqe->res;
+			uring_cqe_seen(&ring);
+			inflight--;
 
-	if (argc != 1) {
-		usage();
+			if (res < 0) {
+				ret = res;
+				continue;
+			}
+			if (ret)
+				continue;
+
+			res &= ~511;
+			scan_buf(s, iov[i].iov_base, res, pos[i]);
+
+			if (res && res < iov[i].iov_len &&
+			    pos[i] + res < s->size) {
+				/* short read: the rest of this chunk */
+				pos[i] += res;
+				iov[i].iov_base += res;
+				iov[i].iov_len -= res;
+			} else if (next < s->size) {
+				pos[i] = next;
+				iov[i].iov_base = bufs + (size_t) i * SCAN_CHUNK;
+				iov[i].iov_len = SCAN_CHUNK;
+				next += SCAN_CHUNK;
+			} else {
+				continue;
+			}
+
+			sqe = uring_get_sqe(&ring);
+			uring_prep_rw(sqe, IORING_OP_READV, s->fd, &iov[i], 1,
+				      pos[i], i);
+			inflight++;
+		}
+	}
+
+	uring_exit(&ring);
+	/* our own errors aren't a reason to retry without io_uring */
+	return ret == -ENOSYS ? -EIO : ret;
+}
+
+static int cmp_start(const void *_l, const void *_r)
+{
+	const struct show *l = _l, *r = _r;
+
+	return (l->start > r->start) - (l->start < r->start);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns 0, or an errno with a message printed */
+static int scan_dev(struct scan *s)
+{
+	unsigned char *bufs;
+	uint64_t start;
+	off_t size;
+	int ret;
+
+	s->fd = open(s->dev, O_RDONLY|O_DIRECT);
+	if (s->fd < 0 && errno == EINVAL)
+		s->fd = open(s->dev, O_RDONLY);
+	if (s->fd < 0) {
+		ret = errno;
+		fprintf(stderr, "Can't open dev %s: %s\n", s->dev, strerror(ret));
+		return ret;
+	}
+
+	s->sb_fd = open(s->dev, O_RDONLY);
+	size = lseek(s->fd, 0, SEEK_END);
+	if (s->sb_fd < 0 || size < 0) {
+		ret = errno;
+		fprintf(stderr, "Can't open dev %s: %s\n", s->dev, strerror(ret));
+		goto out;
+	}
+	s->size = size;
+
+	if (posix_memalign((void **) &bufs, 4096,
+			   (size_t) SCAN_QD * SCAN_CHUNK)) {
+		fprintf(stderr, "Out of memory\n");
 		exit(1);
 	}
 
-	int fd = open(argv[0], O_RDONLY);
-	if (fd < 0) {
-		printf("Can't open dev %s: %s\n", argv[0], strerror(errno));
-		exit(2);
+	start = now_ns();
+	ret = scan_uring(s, bufs);
+	if (ret == -ENOSYS || ret == -EPERM || ret == -ENOMEM)
+		ret = scan_sync(s, bufs);
+	free(bufs);
+
+	if (ret) {
+		ret = -ret;
+		fprintf(stderr, "Error reading %s: %s\n", s->dev, strerror(ret));
+		goto out;
 	}
 
-	if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb)) {
+	qsort(s->hits, s->nr_hits, sizeof(*s->hits), cmp_start);
+
+	fprintf(stderr, "%s: scanned %" PRIu64 " MiB in %.1f s, "
+		"%u valid superblocks of %" PRIu64 " magic matches\n",
+		s->dev, s->size >> 20, (now_ns() - start) / 1e9,
+		s->nr_hits, s->matches);
+out:
+	if (s->sb_fd >= 0)
+		close(s->sb_fd);
+	close(s->fd);
+	return ret;
+}
+
+/* Group the valid cache superblocks by set; returns the number of sets */
+static unsigned check_sets(struct show *list, unsigned nr, struct cset *sets)
+{
+	unsigned i, k, nr_sets = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct cache_sb *sb = &list[i].sb;
+		struct cache_sb_info *info = &list[i].info;
+		struct cset *c;
+
+		if (list[i].err || !info->magic_ok || !info->offset_ok ||
+		    !info->csum_ok || !info->version || info->bdev)
+			continue;
+
+		for (k = 0; k < nr_sets; k++)
+			if (!uuid_compare(sets[k].uuid, sb->set_uuid))
+				break;
+
+		c = &sets[k];
+		if (k == nr_sets) {
+			nr_sets++;
+			uuid_copy(c->uuid, sb->set_uuid);
+			c->nr_in_set	= sb->nr_in_set;
+			c->block_size	= sb->block_size;
+			c->bucket_size	= info->bucket_size;
+		}
+
+		list[i].cset = c;
+		c->seen++;
+
+		if (sb->nr_in_set != c->nr_in_set)
+			c->problems |= CSET_NR_IN_SET;
+		if (sb->block_size != c->block_size ||
+		    info->bucket_size != c->bucket_size)
+			c->problems |= CSET_GEOMETRY;
+
+		if (!sb->nr_in_set || sb->nr_in_set > MAX_CACHES_PER_SET ||
+		    sb->nr_this_dev >= sb->nr_in_set) {
+			c->problems |= CSET_OUT_OF_RANGE;
+			continue;
+		}
+
+		if (c->members & (1ULL << sb->nr_this_dev))
+			c->problems |= CSET_DUPLICATE;
+		c->members |= 1ULL << sb->nr_this_dev;
+	}
+
+	return nr_sets;
+}
+
+/* Returns 2 if the set is inconsistent; missing members are only noted */
+static int show_set(struct cset *c)
+{
+	unsigned i, missing = 0;
+	char uuid[40];
+
+	uuid_unparse(c->uuid, uuid);
+	printf("cset %s: %u of %u cache devices", uuid, c->seen,
+	       c->nr_in_set);
+
+	for (i = 0; i < c->nr_in_set && i < MAX_CACHES_PER_SET; i++)
+		if (!(c->members & (1ULL << i)))
+			printf(missing++ ? " %u" : ", missing nr_this_dev %u",
+			       i);
+	putchar('\n');
+
+	for (i = 0; cset_problems[i]; i++)
+		if (c->problems & (1U << i))
+			printf("\tproblem: %s\n", cset_problems[i]);
+
+	if (!c->problems)
+		return 0;
+
+	fprintf(stderr, "Inconsistent cache set %s\n", uuid);
+	return 2;
+}
+
+/*
+ * The historical output, and exit code: 2 if the device couldn't be read or
+ * the superblock is invalid, 3 if we don't understand it.
+ */
+static int show_text(struct show *s, bool force_csum)
+{
+	struct cache_sb *sb = &s->sb;
+	struct cache_sb_info *info = &s->info;
+	char uuid[40];
+
+	if (s->err && s->opened) {
 		fprintf(stderr, "Couldn't read\n");
-		exit(2);
+		return 2;
+	} else if (s->err) {
+		printf("Can't open dev %s: %s\n", s->dev, strerror(s->err));
+		return 2;
 	}
 
 	printf("sb.magic\t\t");
-	if (!memcmp(sb.magic, bcache_magic, 16)) {
+	if (info->magic_ok) {
 		printf("ok\n");
 	} else {
 		printf("bad magic\n");
 		fprintf(stderr, "Invalid superblock (bad magic)\n");
-		exit(2);
+		return 2;
 	}
 
-	printf("sb.first_sector\t\t%" PRIu64, sb.offset);
-	if (sb.offset == SB_SECTOR) {
+	printf("sb.first_sector\t\t%" PRIu64, sb->offset);
+	if (info->offset_ok) {
 		printf(" [match]\n");
 	} else {
 		printf(" [expected %ds]\n", SB_SECTOR);
 		fprintf(stderr, "Invalid superblock (bad sector)\n");
-		exit(2);
+		return 2;
 	}
 
-	printf("sb.csum\t\t\t%" PRIX64, sb.csum);
-	expected_csum = csum_set(&sb);
-	if (sb.csum == expected_csum) {
+	printf("sb.csum\t\t\t%" PRIX64, sb->csum);
+	if (info->csum_ok) {
 		printf(" [match]\n");
 	} else {
-		printf(" [expected %" PRIX64 "]\n", expected_csum);
+		if (sb->keys > SB_JOURNAL_BUCKETS)
+			printf(" [%" PRIu64 " journal keys, can't check]\n",
+			       (uint64_t) sb->keys);
+		else
+			printf(" [expected %" PRIX64 "]\n",
+			       info->expected_csum);
 		if (!force_csum) {
 			fprintf(stderr, "Corrupt superblock (bad csum)\n");
-			exit(2);
+			return 2;
 		}
 	}
 
-	printf("sb.version\t\t%" PRIu64, sb.version);
-	switch (sb.version) {
-		// These are handled the same by the kernel
-		case BCACHE_SB_VERSION_CDEV:
-		case BCACHE_SB_VERSION_CDEV_WITH_UUID:
-			printf(" [cache device]\n");
-			break;
-
-		// The second adds data offset support
-		case BCACHE_SB_VERSION_BDEV:
-		case BCACHE_SB_VERSION_BDEV_WITH_OFFSET:
-			printf(" [backing device]\n");
-			break;
-
-		default:
-			printf(" [unknown]\n");
-			// exit code?
-			return 0;
+	printf("sb.version\t\t%" PRIu64, sb->version);
+	if (!info->version) {
+		printf(" [unknown]\n");
+		// exit code?
+		return 0;
+	}
+	printf(" [%s]\n", info->version);
+
+	if (SB_HAS_FEATURES(sb)) {
+		printf("sb.feature_compat\t%#" PRIx64 "\n"
+		       "sb.feature_ro_compat\t%#" PRIx64 "\n"
+		       "sb.feature_incompat\t%#" PRIx64,
+		       sb->feature_compat, sb->feature_ro_compat,
+		       sb->feature_incompat);
+		if (sb->feature_incompat &
+		    BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE)
+			printf(" [large_bucket]");
+		else if (sb->feature_incompat &
+			 BCH_FEATURE_INCOMPAT_OBSO_LARGE_BUCKET)
+			printf(" [obso_large_bucket]");
+		putchar('\n');
+
+		if (info->unknown_features)
+			fprintf(stderr, "Unknown features; "
+				"fields may be decoded wrongly\n");
 	}
 
 	putchar('\n');
 
-	char label[SB_LABEL_SIZE + 1];
-	strncpy(label, (char*)sb.label, SB_LABEL_SIZE);
-	label[SB_LABEL_SIZE] = '\0';
 	printf("dev.label\t\t");
-	if (*label)
-		print_encode(label);
+	if (*info->label)
+		print_encode(info->label);
 	else
 		printf("(empty)");
 	putchar('\n');
 
-	uuid_unparse(sb.uuid, uuid);
+	uuid_unparse(sb->uuid, uuid);
 	printf("dev.uuid\t\t%s\n", uuid);
 
 	printf("dev.sectors_per_block\t%u\n"
-	       "dev.sectors_per_bucket\t%u\n",
-	       sb.block_size,
-	       sb.bucket_size);
+	       "dev.sectors_per_bucket\t%" PRIu64 "\n",
+	       sb->block_size,
+	       info->bucket_size);
 
-	if (!SB_IS_BDEV(&sb)) {
+	if (!info->bdev) {
 		// total_sectors includes the superblock;
-		printf("dev.cache.first_sector\t%u\n"
+		printf("dev.cache.first_sector\t%ju\n"
 		       "dev.cache.cache_sectors\t%ju\n"
 		       "dev.cache.total_sectors\t%ju\n"
 		       "dev.cache.ordered\t%s\n"
 		       "dev.cache.discard\t%s\n"
 		       "dev.cache.pos\t\t%u\n"
 		       "dev.cache.replacement\t%ju",
-		       sb.bucket_size * sb.first_bucket,
-		       sb.bucket_size * (sb.nbuckets - sb.first_bucket),
-		       sb.bucket_size * sb.nbuckets,
-		       CACHE_SYNC(&sb) ? "yes" : "no",
-		       CACHE_DISCARD(&sb) ? "yes" : "no",
-		       sb.nr_this_dev,
-			   CACHE_REPLACEMENT(&sb));
-		switch (CACHE_REPLACEMENT(&sb)) {
-			case CACHE_REPLACEMENT_LRU:
-				printf(" [lru]\n");
-				break;
-			case CACHE_REPLACEMENT_FIFO:
-				printf(" [fifo]\n");
-				break;
-			case CACHE_REPLACEMENT_RANDOM:
-				printf(" [random]\n");
-				break;
-			default:
-				putchar('\n');
+		       info->first_sector,
+		       info->cache_sectors,
+		       info->total_sectors,
+		       CACHE_SYNC(sb) ? "yes" : "no",
+		       CACHE_DISCARD(sb) ? "yes" : "no",
+		       sb->nr_this_dev,
+		       CACHE_REPLACEMENT(sb));
+		if (info->replacement)
+			printf(" [%s]\n", info->replacement);
+		else
+			putchar('\n');
+
+		if (sb->keys) {
+			printf("dev.cache.journal\t%u buckets, %" PRIu64
+			       " sectors", sb->keys,
+			       info->bucket_size * sb->keys);
+			if (info->journal_ok)
+				printf(" [from bucket %u]\n", sb->first_bucket);
+			else
+				printf(" [not laid out from first_bucket]\n");
 		}
-
 	} else {
-		uint64_t first_sector;
-		if (sb.version == BCACHE_SB_VERSION_BDEV) {
-			first_sector = BDEV_DATA_START_DEFAULT;
-		} else {
-			if (sb.keys == 1 || sb.d[0]) {
-				fprintf(stderr,
-					"Possible experimental format detected, bailing\n");
-				exit(3);
-			}
-			first_sector = sb.data_offset;
+		if (info->experimental) {
+			fprintf(stderr,
+				"Possible experimental format detected, bailing\n");
+			return 3;
 		}
 
 		printf("dev.data.first_sector\t%ju\n"
 		       "dev.data.cache_mode\t%ju",
-		       first_sector,
-		       BDEV_CACHE_MODE(&sb));
-		switch (BDEV_CACHE_MODE(&sb)) {
-			case CACHE_MODE_WRITETHROUGH:
-				printf(" [writethrough]\n");
+		       info->first_sector,
+		       BDEV_CACHE_MODE(sb));
+		if (info->cache_mode)
+			printf(" [%s]\n", info->cache_mode);
+		else
+			putchar('\n');
+
+		printf("dev.data.cache_state\t%ju [%s]\n",
+		       BDEV_STATE(sb), info->state);
+	}
+	putchar('\n');
+
+	uuid_unparse(sb->set_uuid, uuid);
+	printf("cset.uuid\t\t%s\n", uuid);
+
+	return 0;
+}
+
+static void json_string(const char *str)
+{
+	const unsigned char *c;
+
+	if (!str) {
+		printf("null");
+		return;
+	}
+
+	putchar('"');
+	for (c = (const unsigned char *) str; *c; c++)
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if (*c < 0x20 || *c >= 0x7f)
+			/* labels needn't be utf-8; keep the output valid */
+			printf("\\u%04x", *c);
+		else
+			putchar(*c);
+	putchar('"');
+}
+
+static void json_uuid(const char *key, const uuid_t u)
+{
+	char uuid[40];
+
+	uuid_unparse(u, uuid);
+	printf("\"%s\":\"%s\"", key, uuid);
+}
+
+static const char *json_bool(bool b)
+{
+	return b ? "true" : "false";
+}
+
+/* Every field, whatever state the superblock is in; keys follow show_text() */
+static void show_json(struct show *s)
+{
+	struct cache_sb *sb = &s->sb;
+	struct cache_sb_info *info = &s->info;
+
+	printf("{\"device\":");
+	json_string(s->dev);
+	if (s->scanned)
+		printf(",\"start\":%" PRIu64, s->start);
+
+	if (s->err) {
+		printf(",\"error\":");
+		json_string(strerror(s->err));
+		printf(",\"valid\":false}");
+		return;
+	}
+
+	printf(",\"valid\":%s",
+	       json_bool(info->magic_ok && info->offset_ok &&
+			 info->csum_ok && info->version &&
+			 !info->experimental && !info->unknown_features));
+
+	printf(",\"sb\":{\"magic\":%s", json_bool(info->magic_ok));
+	if (!info->magic_ok) {
+		printf("}}");
+		return;
+	}
+
+	printf(",\"first_sector\":%" PRIu64 ",\"first_sector_ok\":%s"
+	       ",\"csum\":\"%" PRIX64 "\",\"csum_ok\":%s",
+	       sb->offset, json_bool(info->offset_ok),
+	       sb->csum, json_bool(info->csum_ok));
+	if (sb->keys <= SB_JOURNAL_BUCKETS)
+		printf(",\"csum_expected\":\"%" PRIX64 "\"",
+		       info->expected_csum);
+	else
+		printf(",\"csum_expected\":null");
+	printf(",\"version\":%" PRIu64 ",\"version_name\":", sb->version);
+	json_string(info->version);
+	if (SB_HAS_FEATURES(sb))
+		printf(",\"feature_compat\":%" PRIu64
+		       ",\"feature_ro_compat\":%" PRIu64
+		       ",\"feature_incompat\":%" PRIu64
+		       ",\"unknown_features\":%s",
+		       sb->feature_compat, sb->feature_ro_compat,
+		       sb->feature_incompat,
+		       json_bool(info->unknown_features));
+	printf("}");
+
+	printf(",\"dev\":{\"label\":");
+	json_string(info->label);
+	printf(",");
+	json_uuid("uuid", sb->uuid);
+	printf(",\"sectors_per_block\":%u,\"sectors_per_bucket\":%" PRIu64,
+	       sb->block_size, info->bucket_size);
+
+	if (info->version && !info->bdev) {
+		printf(",\"cache\":{\"first_sector\":%" PRIu64
+		       ",\"cache_sectors\":%" PRIu64
+		       ",\"total_sectors\":%" PRIu64
+		       ",\"ordered\":%s,\"discard\":%s"
+		       ",\"pos\":%u,\"nr_in_set\":%u"
+		       ",\"journal_buckets\":%u,\"journal_sectors\":%" PRIu64
+		       ",\"journal_ok\":%s"
+		       ",\"replacement\":%" PRIu64 ",\"replacement_name\":",
+		       info->first_sector, info->cache_sectors,
+		       info->total_sectors,
+		       json_bool(CACHE_SYNC(sb)), json_bool(CACHE_DISCARD(sb)),
+		       sb->nr_this_dev, sb->nr_in_set,
+		       sb->keys, info->bucket_size * sb->keys,
+		       json_bool(info->journal_ok),
+		       CACHE_REPLACEMENT(sb));
+		json_string(info->replacement);
+		printf("}");
+	} else if (info->version) {
+		printf(",\"data\":{\"first_sector\":%" PRIu64
+		       ",\"experimental\":%s"
+		       ",\"cache_mode\":%" PRIu64 ",\"cache_mode_name\":",
+		       info->first_sector, json_bool(info->experimental),
+		       BDEV_CACHE_MODE(sb));
+		json_string(info->cache_mode);
+		printf(",\"cache_state\":%" PRIu64 ",\"cache_state_name\":",
+		       BDEV_STATE(sb));
+		json_string(info->state);
+		printf("}");
+	}
+	printf("}");
+
+	printf(",\"cset\":{");
+	json_uuid("uuid", sb->set_uuid);
+	if (s->cset) {
+		struct cset *c = s->cset;
+		unsigned i, n = 0;
+
+		printf(",\"members_seen\":%u,\"nr_in_set\":%u,\"missing\":[",
+		       c->seen, c->nr_in_set);
+		for (i = 0; i < c->nr_in_set && i < MAX_CACHES_PER_SET; i++)
+			if (!(c->members & (1ULL << i)))
+				printf(n++ ? ",%u" : "%u", i);
+		printf("],\"problems\":[");
+		for (i = 0, n = 0; cset_problems[i]; i++)
+			if (c->problems & (1U << i)) {
+				if (n++)
+					putchar(',');
+				json_string(cset_problems[i]);
+			}
+		printf("]");
+	}
+	printf("}}");
+}
+
+int main(int argc, char **argv)
+{
+	bool force_csum = false, scan = false;
+	enum output output = OUTPUT_TEXT;
+	unsigned i, nr, nr_sets, nr_threads = SHOW_THREADS;
+	struct show_queue q = { 0 };
+	struct cset *sets;
+	struct show *list;
+	pthread_t *threads;
+	glob_t g = { 0 };
+	int o, ret = 0, r;
+	extern char *optarg;
+	char *end;
+
+	while ((o = getopt(argc, argv, "fo:j:s")) != EOF)
+		switch (o) {
+			case 'f':
+				force_csum = 1;
 				break;
-			case CACHE_MODE_WRITEBACK:
-				printf(" [writeback]\n");
+
+			case 's':
+				scan = true;
 				break;
-			case CACHE_MODE_WRITEAROUND:
-				printf(" [writearound]\n");
+
+			case 'o':
+				if (!strcmp(optarg, "text"))
+					output = OUTPUT_TEXT;
+				else if (!strcmp(optarg, "json"))
+					output = OUTPUT_JSON;
+				else if (!strcmp(optarg, "ndjson"))
+					output = OUTPUT_NDJSON;
+				else {
+					fprintf(stderr, "Bad output format %s\n",
+						optarg);
+					exit(1);
+				}
 				break;
-			case CACHE_MODE_NONE:
-				printf(" [no caching]\n");
+
+			case 'j':
+				nr_threads = strtoul(optarg, &end, 10);
+				if (*end || !nr_threads) {
+					usage();
+					exit(1);
+				}
 				break;
+
 			default:
-				putchar('\n');
+				usage();
+				exit(1);
 		}
 
-		printf("dev.data.cache_state\t%ju",
-		       BDEV_STATE(&sb));
-		switch (BDEV_STATE(&sb)) {
-			case BDEV_STATE_NONE:
-				printf(" [detached]\n");
-				break;
-			case BDEV_STATE_CLEAN:
-				printf(" [clean]\n");
-				break;
-			case BDEV_STATE_DIRTY:
-				printf(" [dirty]\n");
+	argv += optind;
+	argc -= optind;
+
+	if (argc < 1) {
+		usage();
+		exit(1);
+	}
+
+	/*
+	 * Expand patterns ourselves, so inventory scripts needn't go through
+	 * a shell; anything that doesn't match is taken literally
+	 */
+	for (i = 0; i < argc; i++)
+		if (glob(argv[i], GLOB_NOCHECK|(i ? GLOB_APPEND : 0),
+			 NULL, &g)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+	nr = g.gl_pathc;
+	q.devs = calloc(nr, sizeof(*q.devs));
+	if (!q.devs) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	q.nr = nr;
+
+	for (i = 0; i < nr; i++)
+		q.devs[i].dev = g.gl_pathv[i];
+
+	if (nr_threads > nr)
+		nr_threads = nr;
+
+	if (scan) {
+		/* each scan is sequential i/o already; one device at a time */
+		list = NULL;
+		nr = 0;
+
+		for (i = 0; i < q.nr; i++) {
+			struct scan s = { .dev = q.devs[i].dev };
+
+			if (scan_dev(&s))
+				ret = 2;
+
+			list = realloc(list, (nr + s.nr_hits) * sizeof(*list));
+			if (s.nr_hits && !list) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			memcpy(list + nr, s.hits, s.nr_hits * sizeof(*list));
+			nr += s.nr_hits;
+			free(s.hits);
+		}
+
+		if (!nr)
+			ret = 2;
+	} else if (nr_threads == 1) {
+		show_worker(&q);
+	} else {
+		threads = calloc(nr_threads, sizeof(*threads));
+		if (!threads) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		for (i = 0; i < nr_threads; i++)
+			if (pthread_create(&threads[i], NULL, show_worker, &q)) {
+				fprintf(stderr, "Could not start worker thread\n");
+				exit(1);
+			}
+
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	if (!scan)
+		list = q.devs;
+
+	sets = calloc(nr ?: 1, sizeof(*sets));
+	if (!sets) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	nr_sets = check_sets(list, nr, sets);
+
+	if (output == OUTPUT_JSON)
+		printf("[");
+
+	for (i = 0; i < nr; i++) {
+		switch (output) {
+			case OUTPUT_TEXT:
+				if (i)
+					putchar('\n');
+				if (list[i].scanned)
+					printf("%s: device starts at byte %" PRIu64
+					       " (sector %" PRIu64 ")\n",
+					       list[i].dev, list[i].start,
+					       list[i].start / 512);
+				else if (nr > 1)
+					printf("%s:\n", list[i].dev);
+				r = show_text(&list[i], force_csum);
+				if (r > ret)
+					ret = r;
 				break;
-			case BDEV_STATE_STALE:
-				printf(" [inconsistent]\n");
+
+			case OUTPUT_JSON:
+				printf(i ? ",\n" : "\n");
+				show_json(&list[i]);
 				break;
-			default:
+
+			case OUTPUT_NDJSON:
+				show_json(&list[i]);
 				putchar('\n');
+				break;
 		}
+		fflush(stdout);
 	}
-	putchar('\n');
 
-	uuid_unparse(sb.set_uuid, uuid);
-	printf("cset.uuid\t\t%s\n", uuid);
+	if (output == OUTPUT_JSON)
+		printf("\n]\n");
 
-	return 0;
+	if (output == OUTPUT_TEXT && nr > 1)
+		for (i = 0; i < nr_sets; i++) {
+			if (!i)
+				putchar('\n');
+			r = show_set(&sets[i]);
+			if (r > ret)
+				ret = r;
+		}
+
+	free(sets);
+	globfree(&g);
+	return ret;
 }
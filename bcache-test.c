@@ -8,10 +8,13 @@
 #define _XOPEN_SOURCE 500
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,8 +22,10 @@
 #include <sys/ioctl.h>
 #include <sys/klog.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
@@ -28,10 +33,14 @@
 #include <openssl/rc4.h>
 #include <openssl/md4.h>
 
+#include "uring.h"
+
 static const unsigned char bcache_magic[] = {
 	0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca,
 	0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81 };
 
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
 unsigned char zero[4096];
 
 bool klog = false;
@@ -56,28 +65,41 @@ bool klog = false;
 	}								\
 } while (0)
 
+/* Per thread random numbers, so workers don't contend on random()'s lock */
+struct rng {
+	unsigned short	xsubi[3];
+	double		spare;		/* normal()'s second value, or NaN */
+};
+
+static void rng_init(struct rng *r, unsigned seed)
+{
+	r->xsubi[0] = 0x330e;
+	r->xsubi[1] = seed;
+	r->xsubi[2] = seed >> 16;
+	r->spare = 0 / (double) 0;
+}
+
 /* Marsaglia polar method
  */
-double normal()
+double normal(struct rng *r)
 {
 	double x, y, s;
-	static double n = 0 / (double) 0;
 
-	if (n == n) {
-		x = n;
-		n = 0 / (double) 0;
+	if (r->spare == r->spare) {
+		x = r->spare;
+		r->spare = 0 / (double) 0;
 		return x;
 	}
 
 	do {
-		x = random() / (double) (RAND_MAX / 2) - 1;
-		y = random() / (double) (RAND_MAX / 2) - 1;
+		x = erand48(r->xsubi) * 2 - 1;
+		y = erand48(r->xsubi) * 2 - 1;
 
 		s = x * x + y * y;
 	} while (s >= 1);
 
 	s = sqrt(-2 * log(s) / s);
-	n =	y * s;
+	r->spare = y * s;
 	return  x * s;
 }
 
@@ -103,6 +125,7 @@ struct pagestuff {
 	unsigned char oldcsum[16];
 	int readcount;
 	int writecount;
+	bool inflight;
 };
 
 void flushlog(void)
@@ -143,31 +166,960 @@ void flushlog(void)
 	}
 }
 
-void aio_loop(int nr)
+/*
+ * The I/O engines: sync does each request on the spot with pread/pwrite,
+ * io_uring and libaio (raw syscalls, so no libaio needed) keep up to depth
+ * ios in flight.  An io is one test operation, on the test device and, when
+ * comparing, on the reference device too: one or two requests.
+ */
+#define MAX_IO		(16 * 4096)
+
+struct io {
+	unsigned long	loop;
+	bool		writing;
+	unsigned long	offset;		/* bytes */
+	int		nbytes;
+	unsigned	pending;	/* requests not completed yet */
+	uint64_t	start_ns;
+	void		*buf1, *buf2;
+	struct iovec	iov[2];
+	struct chunk	*chunk;
+	struct io	*next_free;
+};
+
+/* data is the io, with the low bit set for the reference device */
+struct completion {
+	unsigned long	data;
+	long		res;
+	uint64_t	end_ns;		/* when we reaped it, for async engines */
+};
+
+
+enum engine_type {
+	ENGINE_SYNC,
+	ENGINE_URING,
+	ENGINE_AIO,
+};
+
+static const char * const engine_names[] = {
+	"sync",
+	"io_uring",
+	"libaio",
+};
+
+struct engine {
+	enum engine_type	type;
+	unsigned		nr_reqs;	/* most requests in flight */
+
+	struct uring		ring;
+
+	aio_context_t		aio;
+	struct iocb		*iocbs, **queued;
+	unsigned		nr_queued;
+	struct io_event		*events;
+
+	/* sync: requests done, not reaped yet */
+	struct completion	*done;
+	unsigned		nr_done;
+};
+
+static int engine_init(struct engine *e, enum engine_type type,
+		       unsigned nr_reqs)
+{
+	int ret;
+
+	memset(e, 0, sizeof(*e));
+	e->type		= type;
+	e->nr_reqs	= nr_reqs;
+
+	switch (type) {
+	case ENGINE_SYNC:
+		e->done = calloc(nr_reqs, sizeof(*e->done));
+		return e->done ? 0 : -ENOMEM;
+	case ENGINE_URING:
+		return uring_init(&e->ring, nr_reqs);
+	case ENGINE_AIO:
+		e->iocbs	= calloc(nr_reqs, sizeof(*e->iocbs));
+		e->queued	= calloc(nr_reqs, sizeof(*e->queued));
+		e->events	= calloc(nr_reqs, sizeof(*e->events));
+		if (!e->iocbs || !e->queued || !e->events)
+			return -ENOMEM;
+		ret = syscall(__NR_io_setup, nr_reqs, &e->aio);
+		return ret < 0 ? -errno : 0;
+	}
+	return -EINVAL;
+}
+
+static long sync_rw(int fd, bool writing, void *buf, size_t len,
+		    uint64_t offset)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = writing
+			? pwrite(fd, buf + done, len - done, offset + done)
+			: pread(fd, buf + done, len - done, offset + done);
+		if (r < 0)
+			return -errno;
+		if (!r)
+			return done;
+		done += r;
+	}
+	return done;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void engine_queue(struct engine *e, int fd, bool writing,
+			 struct iovec *iov, uint64_t offset, unsigned long data)
+{
+	struct io_uring_sqe *sqe;
+	struct iocb *cb;
+
+	switch (e->type) {
+	case ENGINE_SYNC:
+		e->done[e->nr_done].data = data;
+		e->done[e->nr_done].res = sync_rw(fd, writing, iov->iov_base,
+						  iov->iov_len, offset);
+		e->done[e->nr_done++].end_ns = now_ns();
+		break;
+	case ENGINE_URING:
+		while (!(sqe = uring_get_sqe(&e->ring)))
+			uring_submit(&e->ring, 0);
+		uring_prep_rw(sqe, writing ? IORING_OP_WRITEV : IORING_OP_READV,
+			      fd, iov, 1, offset, data);
+		break;
+	case ENGINE_AIO:
+		cb = &e->iocbs[e->nr_queued];
+		memset(cb, 0, sizeof(*cb));
+		cb->aio_lio_opcode	= writing ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+		cb->aio_fildes		= fd;
+		cb->aio_buf		= (unsigned long) iov->iov_base;
+		cb->aio_nbytes		= iov->iov_len;
+		cb->aio_offset		= offset;
+		cb->aio_data		= data;
+		e->queued[e->nr_queued++] = cb;
+		break;
+	}
+}
+
+/*
+ * Submit what's queued and wait for at least @min completions; returns how
+ * many were stored in @c (up to nr_reqs), or -errno
+ */
+static int engine_reap(struct engine *e, unsigned min, struct completion *c)
+{
+	struct io_uring_cqe *cqe;
+	unsigned i, n = 0;
+	uint64_t end;
+	int ret;
+
+	switch (e->type) {
+	case ENGINE_SYNC:
+		memcpy(c, e->done, e->nr_done * sizeof(*c));
+		n = e->nr_done;
+		e->nr_done = 0;
+		return n;
+	case ENGINE_URING:
+		if ((ret = uring_submit(&e->ring, min)) < 0)
+			return ret;
+		/*
+		 * The kernel doesn't timestamp completions; stamping each one
+		 * as it's peeked is as close as we get
+		 */
+		while (n < e->nr_reqs && (cqe = uring_peek_cqe(&e->ring))) {
+			c[n].data	= cqe->user_data;
+			c[n].res	= cqe->res;
+			c[n++].end_ns	= now_ns();
+			uring_cqe_seen(&e->ring);
+		}
+		return n;
+	case ENGINE_AIO:
+		for (i = 0; i < e->nr_queued; i += ret) {
+			ret = syscall(__NR_io_submit, e->aio,
+				      e->nr_queued - i, e->queued + i);
+			if (ret < 0 && errno != EAGAIN && errno != EINTR)
+				return -errno;
+			if (ret < 0)
+				ret = 0;
+		}
+		e->nr_queued = 0;
+
+		do
+			ret = syscall(__NR_io_getevents, e->aio, min,
+				      e->nr_reqs, e->events, NULL);
+		while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return -errno;
+
+		/* io_getevents() hands back the whole batch at once */
+		end = now_ns();
+		for (i = 0; i < ret; i++) {
+			c[i].data	= e->events[i].data;
+			c[i].res	= e->events[i].res;
+			c[i].end_ns	= end;
+		}
+		return ret;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Latency histograms, HDR style: a bucket per 1/16th of each power of two
+ * of nanoseconds, so any value is within 6.25% of its bucket's, at a fixed
+ * 8k per histogram and an add and a clz per sample.  Each worker records
+ * the test device's ios in its own histograms; only the reporting merges
+ * them.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1U << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum op {
+	OP_READ,
+	OP_WRITE,
+	NR_OPS,
+};
+
+static const char * const op_names[] = {
+	"read",
+	"write",
+};
+
+struct hist {
+	uint64_t	c[HIST_BUCKETS];
+	uint64_t	nr, max;	/* max: ns */
+};
+
+static unsigned hist_idx(uint64_t v)
+{
+	unsigned e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The middle of bucket @i */
+static double hist_value(unsigned i)
+{
+	unsigned e = i / HIST_SUB + HIST_SUB_BITS - 1;
+
+	if (i < HIST_SUB)
+		return i;
+
+	return ((uint64_t) (HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS)) +
+		((1ULL << (e - HIST_SUB_BITS)) - 1) / 2.0;
+}
+
+/* The worker is the only writer; the reporting thread may read along */
+static void hist_add(struct hist *h, uint64_t ns)
+{
+	unsigned i = hist_idx(ns);
+
+	__atomic_store_n(&h->c[i], h->c[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->nr, h->nr + 1, __ATOMIC_RELAXED);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	uint64_t v;
+	unsigned i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		v = __atomic_load_n(&src->c[i], __ATOMIC_RELAXED);
+		dst->c[i] += v;
+		dst->nr += v;
+	}
+	v = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	dst->max = MAX(dst->max, v);
+}
+
+/* The bucket holding the @rank'th sample (from 0) of buckets [lo, hi) */
+static unsigned hist_rank(const struct hist *h, unsigned lo, unsigned hi,
+			  uint64_t rank)
+{
+	unsigned i;
+
+	for (i = lo; i < hi; i++) {
+		if (rank < h->c[i])
+			return i;
+		rank -= h->c[i];
+	}
+	return hi - 1;
+}
+
+static double hist_percentile(const struct hist *h, double p)
+{
+	return hist_value(hist_rank(h, 0, HIST_BUCKETS,
+				    (uint64_t) (h->nr * p / 100)));
+}
+
+/*
+ * Modes, for telling reads that hit the cache from reads that went to the
+ * backing device: those are usually an order of magnitude or more apart.
+ * Sum the buckets by power of two, take every local maximum holding at
+ * least 1% of the samples, and merge neighbouring ones unless the emptiest
+ * power of two between them has less than half of the smaller one.  Each
+ * mode then spans from one such valley to the next.
+ */
+struct mode {
+	double		share;		/* of all samples */
+	double		median;		/* ns */
+};
+
+#define MAX_MODES	4
+
+static unsigned hist_modes(const struct hist *h, struct mode *modes)
+{
+	uint64_t oct[HIST_BUCKETS / HIST_SUB] = { 0 }, in;
+	unsigned nr_oct = HIST_BUCKETS / HIST_SUB;
+	unsigned peaks[MAX_MODES + 1], nr = 0, i, k, v, lo, hi;
+
+	if (!h->nr)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		oct[i / HIST_SUB] += h->c[i];
+
+	for (i = 0; i < nr_oct; i++) {
+		if (oct[i] * 100 < h->nr ||
+		    (i && oct[i - 1] > oct[i]) ||
+		    (i + 1 < nr_oct && oct[i + 1] >= oct[i]))
+			continue;
+
+		if (nr) {
+			for (v = k = peaks[nr - 1]; k < i; k++)
+				if (oct[k] < oct[v])
+					v = k;
+			if (oct[v] * 2 >= MIN(oct[peaks[nr - 1]], oct[i])) {
+				/* one mode; keep the bigger peak */
+				if (oct[i] > oct[peaks[nr - 1]])
+					peaks[nr - 1] = i;
+				continue;
+			}
+		}
+
+		if (nr == MAX_MODES)
+			break;
+		peaks[nr++] = i;
+	}
+
+	for (k = 0, lo = 0; k < nr; k++, lo = hi) {
+		hi = nr_oct;
+		if (k + 1 < nr)
+			for (hi = v = peaks[k]; v < peaks[k + 1]; v++)
+				if (oct[v] < oct[hi])
+					hi = v;
+		hi = k + 1 < nr ? hi + 1 : hi;
+
+		for (i = lo, in = 0; i < hi; i++)
+			in += oct[i];
+
+		modes[k].share	= (double) in / h->nr;
+		modes[k].median	= hist_value(hist_rank(h, lo * HIST_SUB,
+						       hi * HIST_SUB, in / 2));
+	}
+
+	return nr;
+}
+
+/*
+ * The device is split into chunks, each with its own pagestuff.  A worker
+ * thread only touches a chunk while it holds it, so verification needs no
+ * locking, and chunks start out spread over the workers so each one's
+ * pagestuff is allocated (and first touched) by its thread.
+ *
+ * Each worker goes over the chunks in its queue, a batch of ios per chunk;
+ * one that runs out of chunks steals from the other queues, and only when
+ * there's nothing left to steal starts its next pass over the chunks it
+ * did.  Chunks thus drift towards the workers that get through them fastest.
+ * ios start in the first nr - 16 pages of a chunk, so none of them (16
+ * pages at most) crosses into the next one.
+ */
+#define CHUNK_PAGES	16384		/* 64 MiB */
+#define CHUNK_MIN_PAGES	64
+#define CHUNK_OPS	1024		/* ios per chunk per turn */
+
+struct chunk {
+	unsigned long		start;		/* first page */
+	unsigned long		nr;		/* pages */
+	unsigned long		offset;		/* of the last io, in pages */
+	struct pagestuff	*pages;
+	struct chunk		*next;		/* on a worker's done list */
+};
+
+struct chunk_queue {
+	pthread_mutex_t		lock;
+	struct chunk		**c;		/* circular, of nr_chunks */
+	unsigned		head, nr;
+};
+
+struct worker {
+	unsigned		id;
+	pthread_t		thread;
+	struct rng		rng;
+	RC4_KEY			writedata;
+
+	struct engine		engine;
+	struct io		*ios, *free_ios;
+	unsigned		ios_inflight;
+	struct completion	*completions;
+
+	struct chunk_queue	queue;
+	struct chunk		*done_chunks;	/* this pass */
+	unsigned long		last_offset;
+	int			last_nbytes;
+
+	struct hist		lat[NR_OPS];	/* test device only */
+
+	/* read by the main thread for reporting */
+	unsigned long		loops, sectors, unique, stolen;
+	bool			finished;
+} __attribute__((aligned(64)));
+
+static int fd1, fd2;
+static bool csum, walk, randsize, verbose, rtest, wtest;
+static unsigned long benchmark, loops_claimed;
+static unsigned depth = 1, nr_workers = 1, nr_chunks;
+static int engine_type = -1;	/* enum engine_type, or pick one */
+static struct chunk *chunks;
+static struct worker *workers;
+
+static void __attribute__((noreturn)) io_error(void)
+{
+	perror("IO error");
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+static struct pagestuff *io_page(struct io *io, int j)
+{
+	return &io->chunk->pages[(io->offset + j) / 4096 - io->chunk->start];
+}
+
+static void __attribute__((noreturn)) bad_read(struct io *io, int j)
+{
+	struct pagestuff *p = io_page(io, j);
+	unsigned char c[16];
+
+	printf("Bad read! loop %li offset %li readcount %i writecount %i\n",
+	       io->loop, (io->offset + j) >> 9, p->readcount, p->writecount);
+
+	MD4(io->buf1 + j, 4096, &c[0]);
+	if (!memcmp(&p->oldcsum[0], c, 16))
+		printf("Matches previous csum\n");
+
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * The per page bookkeeping, when an io is issued (writes: generate the data
+ * and remember its checksum) or completes (reads: check the data against
+ * the last write, or the reference device).  Returns the offset into the
+ * io of a page that didn't check out, or -1.
+ */
+static int check_io(struct worker *w, struct io *io)
+{
+	struct pagestuff *p;
+	unsigned char c[16];
+	int j;
+
+	for (j = 0; j < io->nbytes; j += 4096) {
+		p = io_page(io, j);
+
+		if (io->writing)
+			RC4(&w->writedata, 4096, zero, io->buf1 + j);
+
+		if (csum) {
+			MD4(io->buf1 + j, 4096, &c[0]);
+
+			if (io->writing ||
+			    (!p->readcount && !p->writecount)) {
+				memcpy(&p->oldcsum[0], &p->csum[0], 16);
+				memcpy(&p->csum[0], c, 16);
+			} else if (memcmp(&p->csum[0], c, 16))
+				return j;
+		} else if (!io->writing && !benchmark &&
+			   memcmp(io->buf1 + j,
+				  io->buf2 + j,
+				  4096))
+			return j;
+
+		if (!p->writecount && !p->readcount)
+			__atomic_fetch_add(&w->unique, 8, __ATOMIC_RELAXED);
+
+		io->writing ? p->writecount++ : p->readcount++;
+	}
+	return -1;
+}
+
+/* ios touching the same page are never in flight together */
+static bool io_overlaps(struct chunk *c, unsigned long offset, int nbytes)
+{
+	int j;
+
+	for (j = 0; j < nbytes; j += 4096)
+		if (c->pages[(offset + j) / 4096 - c->start].inflight)
+			return true;
+	return false;
+}
+
+static void io_inflight(struct io *io, bool inflight)
 {
+	int j;
 
+	for (j = 0; j < io->nbytes; j += 4096)
+		io_page(io, j)->inflight = inflight;
+}
+
+static void reap(struct worker *w, unsigned min)
+{
+	struct io *io;
+	int i, n, j;
+
+	n = engine_reap(&w->engine, min, w->completions);
+	if (n < 0) {
+		errno = -n;
+		io_error();
+	}
+
+	for (i = 0; i < n; i++) {
+		io = (void *) (w->completions[i].data & ~1UL);
+
+		if (w->completions[i].res != io->nbytes) {
+			errno = w->completions[i].res < 0
+				? -w->completions[i].res : EIO;
+			io_error();
+		}
+
+		if (!(w->completions[i].data & 1))
+			hist_add(&w->lat[io->writing ? OP_WRITE : OP_READ],
+				 w->completions[i].end_ns - io->start_ns);
+
+		if (--io->pending)
+			continue;
+
+		if (!io->writing && (j = check_io(w, io)) >= 0)
+			bad_read(io, j);
+
+		io_inflight(io, false);
+		io->next_free = w->free_ios;
+		w->free_ios = io;
+		w->ios_inflight--;
+	}
+}
+
+static void issue(struct worker *w, struct io *io)
+{
+	bool compare = !csum && !benchmark;
+
+	io_inflight(io, true);
+	w->ios_inflight++;
+
+	if (io->writing)
+		check_io(w, io);
+
+	io->pending = 1 + compare;
+	io->iov[0].iov_base = io->buf1;
+	io->iov[0].iov_len = io->nbytes;
+	io->start_ns = now_ns();
+	engine_queue(&w->engine, fd1, io->writing, &io->iov[0], io->offset,
+		     (unsigned long) io);
+
+	if (compare) {
+		/* the reference device gets the same data */
+		io->iov[1].iov_base = io->writing ? io->buf1 : io->buf2;
+		io->iov[1].iov_len = io->nbytes;
+		engine_queue(&w->engine, fd2, io->writing, &io->iov[1],
+			     io->offset, (unsigned long) io | 1);
+	}
+}
+
+static FILE *csv;
+static uint64_t start_ns;
+
+static void print_hist(const char *scope, enum op op, struct hist *h)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	struct mode modes[MAX_MODES];
+	double p[ARRAY_SIZE(pcts)];
+	unsigned i, nr_modes;
+
+	if (!h->nr)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(pcts); i++)
+		p[i] = hist_percentile(h, pcts[i]) / 1e3;
+
+	printf("%-5s %9lu ios  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+	       "p99.9 %8.1f  max %8.1f us\n", op_names[op],
+	       (unsigned long) h->nr, p[0], p[1], p[2], p[3], h->max / 1e3);
+
+	nr_modes = op == OP_READ ? hist_modes(h, modes) : 0;
+	if (nr_modes > 1) {
+		printf("%-5s modes:", op_names[op]);
+		for (i = 0; i < nr_modes; i++)
+			printf("%s %.1f%% around %.1f us", i ? "," : "",
+			       modes[i].share * 100, modes[i].median / 1e3);
+		printf(" (fastest: cache hits?)\n");
+	}
+
+	if (!csv)
+		return;
+
+	fprintf(csv, "%.3f,%s,%s,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,",
+		(now_ns() - start_ns) / 1e9, scope, op_names[op],
+		(unsigned long) h->nr, p[0], p[1], p[2], p[3], h->max / 1e3);
+	for (i = 0; i < nr_modes; i++)
+		fprintf(csv, "%s%.3f@%.1f", i ? ";" : "",
+			modes[i].share, modes[i].median / 1e3);
+	fputc('\n', csv);
+	fflush(csv);
+}
+
+/*
+ * Latency of the test device's ios, over all workers: since the last call,
+ * or with @total since the start
+ */
+static void report_latency(bool total)
+{
+	static struct hist prev[NR_OPS], cur[NR_OPS], d;
+	unsigned op, i;
+
+	for (op = 0; op < NR_OPS; op++) {
+		memset(&cur[op], 0, sizeof(cur[op]));
+		for (i = 0; i < nr_workers; i++)
+			hist_merge(&cur[op], &workers[i].lat[op]);
+
+		if (total) {
+			print_hist("total", op, &cur[op]);
+			continue;
+		}
+
+		/* the interval's max is only known to its bucket */
+		memset(&d, 0, sizeof(d));
+		for (i = 0; i < HIST_BUCKETS; i++)
+			if ((d.c[i] = cur[op].c[i] - prev[op].c[i])) {
+				d.nr += d.c[i];
+				d.max = hist_value(i);
+			}
+		prev[op] = cur[op];
+
+		print_hist("interval", op, &d);
+	}
+	fflush(stdout);
+}
+
+static void print_loop(struct worker *w, unsigned long i,
+		       unsigned long offset, int nbytes)
+{
+	if (nr_workers > 1)
+		printf("Thread %2u ", w->id);
+	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
+	       i, offset >> 9, nbytes >> 9, w->sectors >> 11, w->unique >> 11);
+}
+
+/* Up to @nr more loops, within -b */
+static unsigned long claim_loops(unsigned long nr)
+{
+	unsigned long start;
+
+	if (!benchmark)
+		return nr;
+
+	start = __atomic_fetch_add(&loops_claimed, nr, __ATOMIC_RELAXED);
+	return start >= benchmark ? 0 : MIN(nr, benchmark - start);
+}
+
+static void run_chunk(struct worker *w, struct chunk *c, unsigned long nr)
+{
+	static time_t last_printed;
+	unsigned long i, k, offset;
+	struct io *io;
+	int nbytes;
+
+	for (k = 0; k < nr; k++) {
+		i = w->loops;
+		bool writing = (wtest && (i & 1)) || !rtest;
+		nbytes = randsize ? erand48(w->rng.xsubi) * 16 + 1 : 1;
+		nbytes <<= 12;
+
+		c->offset += walk ? normal(&w->rng) * 20 : nrand48(w->rng.xsubi);
+		c->offset %= c->nr - 16;
+		offset = (c->start + c->offset) << 12;
+
+		if (!w->id && !(i % 200))
+			flushlog();
+
+		if (!verbose) {
+			time_t now = time(NULL);
+			if (nr_workers == 1 && now - last_printed >= 2) {
+				last_printed = now;
+				print_loop(w, i, offset, nbytes);
+				report_latency(false);
+			}
+		} else
+			print_loop(w, i, offset, nbytes);
+
+		__atomic_fetch_add(&w->sectors, nbytes >> 9, __ATOMIC_RELAXED);
+
+		while (!w->free_ios || io_overlaps(c, offset, nbytes))
+			reap(w, 1);
+
+		io = w->free_ios;
+		w->free_ios = io->next_free;
+
+		io->loop	= i;
+		io->writing	= writing;
+		io->offset	= offset;
+		io->nbytes	= nbytes;
+		io->chunk	= c;
+		issue(w, io);
+
+		w->last_offset	= offset;
+		w->last_nbytes	= nbytes;
+
+		/* keep the ring fed, and pick up whatever has finished */
+		reap(w, 0);
+
+		__atomic_store_n(&w->loops, i + 1, __ATOMIC_RELAXED);
+	}
+}
+
+static struct chunk *queue_pop(struct chunk_queue *q, bool tail)
+{
+	struct chunk *c = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->nr) {
+		if (tail) {
+			c = q->c[(q->head + q->nr - 1) % nr_chunks];
+		} else {
+			c = q->c[q->head];
+			q->head = (q->head + 1) % nr_chunks;
+		}
+		q->nr--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return c;
+}
+
+static void queue_push(struct chunk_queue *q, struct chunk *c)
+{
+	pthread_mutex_lock(&q->lock);
+	q->c[(q->head + q->nr++) % nr_chunks] = c;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Our next chunk: from our queue, stolen, or the start of our next pass */
+static struct chunk *get_chunk(struct worker *w)
+{
+	struct chunk *c;
+	unsigned i;
+
+	if ((c = queue_pop(&w->queue, false)))
+		return c;
+
+	for (i = 1; i < nr_workers; i++)
+		if ((c = queue_pop(&workers[(w->id + i) % nr_workers].queue,
+				   true))) {
+			w->stolen++;
+			return c;
+		}
+
+	while ((c = w->done_chunks)) {
+		w->done_chunks = c->next;
+		queue_push(&w->queue, c);
+	}
+
+	return queue_pop(&w->queue, false);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct chunk *c;
+	unsigned long nr;
+	unsigned i;
+
+	while ((nr = claim_loops(CHUNK_OPS))) {
+		while (!(c = get_chunk(w)))
+			/* everything we had was stolen, and is being worked on */
+			usleep(100);
+
+		run_chunk(w, c, nr);
+
+		/* nobody else may see the chunk with ios in flight */
+		if (nr_workers > 1)
+			while (w->ios_inflight)
+				reap(w, 1);
+
+		c->next = w->done_chunks;
+		w->done_chunks = c;
+	}
+
+	while (w->ios_inflight)
+		reap(w, 1);
+
+	/* for the next worker that needs them, pass back what we hold */
+	while ((c = w->done_chunks)) {
+		w->done_chunks = c->next;
+		queue_push(&w->queue, c);
+	}
+
+	for (i = 0; i < depth; i++) {
+		free(w->ios[i].buf1);
+		free(w->ios[i].buf2);
+	}
+
+	__atomic_store_n(&w->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void worker_init(struct worker *w)
+{
+	int ret, tried = engine_type;
+	unsigned i;
+
+	/* up to two requests per io */
+	ret = engine_init(&w->engine, tried, depth * 2);
+	if (ret == -ENOSYS && tried == ENGINE_URING)
+		ret = engine_init(&w->engine, tried = ENGINE_AIO, depth * 2);
+	if (ret) {
+		fprintf(stderr, "Can't set up %s%s: %s\n", engine_names[tried],
+			tried != engine_type ? " (no io_uring either)" : "",
+			strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	w->ios = calloc(depth, sizeof(*w->ios));
+	w->completions = calloc(depth * 2, sizeof(*w->completions));
+	w->queue.c = calloc(nr_chunks, sizeof(*w->queue.c));
+	if (!w->ios || !w->completions || !w->queue.c) {
+		printf("Could not allocate buffers\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&w->queue.lock, NULL);
+
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign(&w->ios[i].buf1, 4096, MAX_IO) ||
+		    posix_memalign(&w->ios[i].buf2, 4096, MAX_IO)) {
+			printf("Could not allocate buffers\n");
+			exit(EXIT_FAILURE);
+		}
+		w->ios[i].next_free = w->free_ios;
+		w->free_ios = &w->ios[i];
+	}
+
+	/* one data stream per thread, but the same one as ever for thread 0 */
+	RC4_set_key(&w->writedata, 16, bcache_magic);
+	for (i = 0; i < w->id; i++)
+		RC4(&w->writedata, sizeof(zero), zero, w->ios[0].buf1);
+
+	rng_init(&w->rng, w->id);
+}
+
+/* Chunk @i goes to worker @i % nr_workers, which allocates its pagestuff */
+static void *worker_alloc(void *arg)
+{
+	struct worker *w = arg;
+	unsigned i;
+
+	for (i = w->id; i < nr_chunks; i += nr_workers) {
+		if (posix_memalign((void **) &chunks[i].pages, 64,
+				   chunks[i].nr * sizeof(struct pagestuff))) {
+			printf("Could not allocate buffers\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(chunks[i].pages, 0,
+		       chunks[i].nr * sizeof(struct pagestuff));
+		queue_push(&w->queue, &chunks[i]);
+	}
+	return NULL;
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(double start, bool per_thread)
+{
+	double elapsed = now_secs() - start;
+	unsigned long sectors = 0, unique = 0;
+	unsigned i;
+
+	for (i = 0; i < nr_workers; i++) {
+		sectors	+= __atomic_load_n(&workers[i].sectors, __ATOMIC_RELAXED);
+		unique	+= __atomic_load_n(&workers[i].unique, __ATOMIC_RELAXED);
+	}
+
+	printf("%6lu mb done, %6lu mb unique, %8.1f MB/s\n",
+	       sectors >> 11, unique >> 11,
+	       elapsed > 0 ? sectors / 2048.0 / elapsed : 0);
+
+	if (per_thread)
+		for (i = 0; i < nr_workers; i++) {
+			sectors = __atomic_load_n(&workers[i].sectors,
+						  __ATOMIC_RELAXED);
+			printf("  thread %2u: %6lu mb, %8.1f MB/s, "
+			       "%lu chunks stolen\n", i, sectors >> 11,
+			       elapsed > 0 ? sectors / 2048.0 / elapsed : 0,
+			       workers[i].stolen);
+		}
+	fflush(stdout);
 }
 
 void usage()
 {
+	fprintf(stderr,
+		"Usage: bcache-test [options] device [reference device]\n"
+		"	-d		O_DIRECT\n"
+		"	-n		walk the device instead of random offsets\n"
+		"	-s		random sizes, 4k to 64k\n"
+		"	-c		check against checksums, no reference device\n"
+		"	-w		writes as well as reads\n"
+		"	-b loops	benchmark: stop after this many, don't check\n"
+		"	-q depth	keep this many ios in flight (default 1)\n"
+		"	-e engine	sync, io_uring or libaio (default io_uring,\n"
+		"			falling back to libaio, with -q)\n"
+		"	-j threads	run this many threads, each on its own\n"
+		"			part of the device at any time\n"
+		"	-o file		log latency percentiles to file as CSV\n"
+		"			(with io_uring and libaio, latency runs up to\n"
+		"			when the completion is reaped, so it includes\n"
+		"			batching delay that grows with -q)\n"
+		"	-l		save the kernel log\n"
+		"	-v		verbose\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
-	bool walk = false, randsize = false, verbose = false, csum = false, rtest = false, wtest = false;
-	int fd1, fd2 = 0, direct = 0, nbytes = 4096, j, o;
-	unsigned long size, i, offset = 0, done = 0, unique = 0, benchmark = 0;
-	void *buf1 = NULL, *buf2 = NULL;
-	struct pagestuff *pages, *p;
-	unsigned char c[16];
-	time_t last_printed = 0;
+	unsigned long pages, chunk_pages, i;
+	unsigned finished;
+	double start, last;
+	int direct = 0, o;
 	extern char *optarg;
 
-	RC4_KEY writedata;
-	RC4_set_key(&writedata, 16, bcache_magic);
-
-	while ((o = getopt(argc, argv, "dnwvscwlb:")) != EOF)
+	while ((o = getopt(argc, argv, "dnrwvsclb:q:e:j:o:")) != EOF)
 		switch (o) {
 		case 'd':
 			direct = O_DIRECT;
@@ -196,6 +1148,33 @@ int main(int argc, char **argv)
 		case 'b':
 			benchmark = atol(optarg);
 			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (!depth || depth > 4096)
+				usage();
+			break;
+		case 'e':
+			for (engine_type = 0;
+			     engine_type < (int) ARRAY_SIZE(engine_names) &&
+			     strcmp(optarg, engine_names[engine_type]);
+			     engine_type++)
+				;
+			if (engine_type == (int) ARRAY_SIZE(engine_names))
+				usage();
+			break;
+		case 'o':
+			if (!(csv = fopen(optarg, "w"))) {
+				perror("Error opening latency log");
+				exit(EXIT_FAILURE);
+			}
+			fprintf(csv, "seconds,scope,op,ios,p50_us,p90_us,p99_us,"
+				"p99.9_us,max_us,modes\n");
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			if (!nr_workers || nr_workers > 1024)
+				usage();
+			break;
 		default:
 			usage();
 		}
@@ -225,96 +1204,97 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	size = getblocks(fd1);
+	pages = getblocks(fd1);
 	if (!csum && !benchmark)
-		size = MIN(size, getblocks(fd2));
+		pages = MIN(pages, getblocks(fd2));
+	pages /= 8;
 
-	size = size / 8 - 16;
-	pages = calloc(size + 16, sizeof(*pages));
-	printf("size %li\n", size);
+	/* one thread: the whole device is one chunk, as it always was */
+	chunk_pages = nr_workers == 1 ? pages : CHUNK_PAGES;
+	if (nr_workers > 1 && pages / chunk_pages < nr_workers * 4)
+		chunk_pages = pages / (nr_workers * 4);
+	if (chunk_pages < CHUNK_MIN_PAGES) {
+		printf("Device too small for %u threads\n", nr_workers);
+		exit(EXIT_FAILURE);
+	}
+	printf("size %li\n", pages - 16);
 
-	if (posix_memalign(&buf1, 4096, 4096 * 16) ||
-	    posix_memalign(&buf2, 4096, 4096 * 16)) {
+	nr_chunks = pages / chunk_pages;
+	chunks = calloc(nr_chunks, sizeof(*chunks));
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!chunks || !workers) {
 		printf("Could not allocate buffers\n");
 		exit(EXIT_FAILURE);
 	}
-	//setvbuf(stdout, NULL, _IONBF, 0);
 
-	for (i = 0; !benchmark || i < benchmark; i++) {
-		bool writing = (wtest && (i & 1)) || !rtest;
-		nbytes = randsize ? drand48() * 16 + 1 : 1;
-		nbytes <<= 12;
+	for (i = 0; i < nr_chunks; i++) {
+		chunks[i].start	= i * chunk_pages;
+		chunks[i].nr	= i + 1 < nr_chunks
+			? chunk_pages
+			: pages - chunks[i].start;
+	}
 
-		offset >>= 12;
-		offset += walk ? normal() * 20 : random();
-		offset %= size;
-		offset <<= 12;
+	if (engine_type < 0)
+		engine_type = depth > 1 ? ENGINE_URING : ENGINE_SYNC;
+	if (engine_type == ENGINE_SYNC)
+		depth = 1;
 
-		if (!(i % 200))
-			flushlog();
-
-		if (!verbose) {
-			time_t now = time(NULL);
-			if (now - last_printed >= 2) {
-				last_printed = now;
-				goto print;
-			}
-		} else
-print:			printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-			       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].id = i;
+		worker_init(&workers[i]);
+	}
 
-		done += nbytes >> 9;
+	if (depth > 1 || nr_workers > 1)
+		printf("engine %s, queue depth %u, %u threads, %u chunks\n",
+		       engine_names[workers[0].engine.type], depth,
+		       nr_workers, nr_chunks);
+	//setvbuf(stdout, NULL, _IONBF, 0);
 
-		if (!writing)
-			Pread(fd1, buf1, nbytes, offset);
-		if (!writing && !csum && !benchmark)
-			Pread(fd2, buf2, nbytes, offset);
+	for (i = 0; i < nr_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_alloc,
+				   &workers[i])) {
+			printf("Could not start worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
 
-		for (j = 0; j < nbytes; j += 4096) {
-			p = &pages[(offset + j) / 4096];
+	start = last = now_secs();
+	start_ns = now_ns();
 
-			if (writing)
-				RC4(&writedata, 4096, zero, buf1 + j);
+	if (nr_workers == 1) {
+		worker_thread(&workers[0]);
+		print_loop(&workers[0], workers[0].loops,
+			   workers[0].last_offset, workers[0].last_nbytes);
+		report_latency(true);
+		exit(EXIT_SUCCESS);
+	}
 
-			if (csum) {
-				MD4(buf1 + j, 4096, &c[0]);
+	for (i = 0; i < nr_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+				   &workers[i])) {
+			printf("Could not start worker thread\n");
+			exit(EXIT_FAILURE);
+		}
 
-				if (writing ||
-				    (!p->readcount && !p->writecount)) {
-					memcpy(&p->oldcsum[0], &p->csum[0], 16);
-					memcpy(&p->csum[0], c, 16);
-				} else if (memcmp(&p->csum[0], c, 16))
-					goto bad;
-			} else if (!writing && !benchmark &&
-				   memcmp(buf1 + j,
-					  buf2 + j,
-					  4096))
-				goto bad;
+	do {
+		usleep(100 * 1000);
 
-			if (!p->writecount && !p->readcount)
-				unique += 8;
+		for (i = 0, finished = 0; i < nr_workers; i++)
+			finished += __atomic_load_n(&workers[i].finished,
+						    __ATOMIC_ACQUIRE);
 
-			writing ? p->writecount++ : p->readcount++;
+		if (finished < nr_workers && now_secs() - last >= 2) {
+			last = now_secs();
+			report(start, verbose);
+			report_latency(false);
 		}
-		if (writing)
-			Pwrite(fd1, buf1, nbytes, offset);
-		if (writing && !csum && !benchmark)
-			Pwrite(fd2, buf2, nbytes, offset);
-	}
-	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-	       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
-	exit(EXIT_SUCCESS);
-err:
-	perror("IO error");
-	flushlog();
-	exit(EXIT_FAILURE);
-bad:
-	printf("Bad read! loop %li offset %li readcount %i writecount %i\n",
-	       i, (offset + j) >> 9, p->readcount, p->writecount);
+	} while (finished < nr_workers);
 
-	if (!memcmp(&p->oldcsum[0], c, 16))
-		printf("Matches previous csum\n");
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
 
-	flushlog();
-	exit(EXIT_FAILURE);
+	report(start, true);
+	report_latency(true);
+	exit(EXIT_SUCCESS);
 }
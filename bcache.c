@@ -1,10 +1,22 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "bcache.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CRC64_CLMUL
+#endif
+
 /*
  * Portions Copyright (c) 1996-2001, PostgreSQL Global Development Group (Any
  * use permitted, subject to terms of PostgreSQL license; see.)
@@ -115,15 +127,373 @@ static const uint64_t crc_table[256] = {
 	0x9AFCE626CE85B507ULL
 };
 
-inline uint64_t crc64(const void *_data, size_t len)
+static uint64_t crc_slice[16][256];
+
+static uint64_t crc64_slice16(uint64_t, const unsigned char *, size_t);
+
+static uint64_t (*crc64_update_fn)(uint64_t, const unsigned char *, size_t) =
+	crc64_slice16;
+
+#ifdef HAVE_CRC64_CLMUL
+/* x^n mod P for the folding constants, see crc64_clmul() */
+static uint64_t k128, k192, k512, k576;
+
+static uint64_t crc64_clmul(uint64_t, const unsigned char *, size_t);
+
+static bool clmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("ssse3");
+}
+#endif
+
+/* a * b mod P */
+static uint64_t gf2_mulmod(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 63; i >= 0; --i) {
+		r = (r << 1) ^ ((r >> 63) ? crc_table[1] : 0);
+		if ((b >> i) & 1)
+			r ^= a;
+	}
+
+	return r;
+}
+
+/* x^n mod P */
+static uint64_t xpow_mod(uint64_t n)
+{
+	uint64_t r = 1, base = 2;
+
+	for (; n; n >>= 1) {
+		if (n & 1)
+			r = gf2_mulmod(r, base);
+		base = gf2_mulmod(base, base);
+	}
+
+	return r;
+}
+
+/*
+ * crc_slice[k][i] is the crc register contribution of byte i followed by k
+ * zero bytes, which lets crc64_slice16() consume 16 bytes per iteration with
+ * independent table lookups (slicing-by-16).  crc_slice[0] is crc_table.
+ *
+ * Also picks the fastest crc64 implementation this cpu supports.
+ */
+static void __attribute__((constructor)) crc64_init_tables(void)
 {
-	uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
-	const unsigned char *data = _data;
+	unsigned i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint64_t crc = crc_table[i];
+
+		crc_slice[0][i] = crc;
+		for (j = 1; j < 16; j++) {
+			crc = crc_table[crc >> 56] ^ (crc << 8);
+			crc_slice[j][i] = crc;
+		}
+	}
+
+#ifdef HAVE_CRC64_CLMUL
+	k128 = xpow_mod(128);
+	k192 = xpow_mod(192);
+	k512 = xpow_mod(512);
+	k576 = xpow_mod(576);
 
+	if (clmul_supported())
+		crc64_update_fn = crc64_clmul;
+#endif
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *data,
+			       size_t len)
+{
 	while (len--) {
 		int i = ((int) (crc >> 56) ^ *data++) & 0xFF;
 		crc = crc_table[i] ^ (crc << 8);
 	}
 
-	return crc ^ 0xFFFFFFFFFFFFFFFFULL;
+	return crc;
+}
+
+static uint64_t crc64_slice16(uint64_t crc, const unsigned char *data,
+			      size_t len)
+{
+	while (len >= 16) {
+		uint64_t hi = crc ^ load_be64(data);
+		uint64_t lo = load_be64(data + 8);
+
+		crc =	crc_slice[15][hi >> 56] ^
+			crc_slice[14][(hi >> 48) & 0xFF] ^
+			crc_slice[13][(hi >> 40) & 0xFF] ^
+			crc_slice[12][(hi >> 32) & 0xFF] ^
+			crc_slice[11][(hi >> 24) & 0xFF] ^
+			crc_slice[10][(hi >> 16) & 0xFF] ^
+			crc_slice[9][(hi >> 8) & 0xFF] ^
+			crc_slice[8][hi & 0xFF] ^
+			crc_slice[7][lo >> 56] ^
+			crc_slice[6][(lo >> 48) & 0xFF] ^
+			crc_slice[5][(lo >> 40) & 0xFF] ^
+			crc_slice[4][(lo >> 32) & 0xFF] ^
+			crc_slice[3][(lo >> 24) & 0xFF] ^
+			crc_slice[2][(lo >> 16) & 0xFF] ^
+			crc_slice[1][(lo >> 8) & 0xFF] ^
+			crc_slice[0][lo & 0xFF];
+
+		data += 16;
+		len -= 16;
+	}
+
+	return crc64_bytewise(crc, data, len);
+}
+
+#ifdef HAVE_CRC64_CLMUL
+#define CLMUL_TARGET	__attribute__((target("pclmul,ssse3")))
+
+static inline CLMUL_TARGET __m128i clmul_load(const unsigned char *p)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+static inline CLMUL_TARGET __m128i clmul_fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+			     _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/*
+ * Carry-less multiply folding, after Gopal et al., "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction".
+ *
+ * Blocks are byte swapped so the first message bit is bit 127.  An
+ * accumulator X = X_hi * x^64 + X_lo that sits n bits ahead of another block
+ * is congruent (mod P) to X_hi * (x^(n+64) mod P) + X_lo * (x^n mod P) at
+ * that block's position; both products fit in 128 bits.  Four accumulators
+ * fold 512 bits at a time to hide the multiply latency, then collapse into
+ * one, and the last 128 bits and any tail go through the table code.  The
+ * incoming register is xored into the first 8 message bytes, as the table
+ * code would do implicitly.
+ */
+static CLMUL_TARGET uint64_t crc64_clmul(uint64_t crc, const unsigned char *data,
+					 size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i fold128 = _mm_set_epi64x(k192, k128);
+	__m128i fold512 = _mm_set_epi64x(k576, k512);
+	__m128i x0, x1, x2, x3;
+	unsigned char buf[16];
+
+	if (len < 128)
+		return crc64_slice16(crc, data, len);
+
+	x0 = _mm_xor_si128(clmul_load(data), _mm_set_epi64x(crc, 0));
+	x1 = clmul_load(data + 16);
+	x2 = clmul_load(data + 32);
+	x3 = clmul_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(clmul_fold(x0, fold512), clmul_load(data));
+		x1 = _mm_xor_si128(clmul_fold(x1, fold512), clmul_load(data + 16));
+		x2 = _mm_xor_si128(clmul_fold(x2, fold512), clmul_load(data + 32));
+		x3 = _mm_xor_si128(clmul_fold(x3, fold512), clmul_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_xor_si128(clmul_fold(x0, fold128), x1);
+	x0 = _mm_xor_si128(clmul_fold(x0, fold128), x2);
+	x0 = _mm_xor_si128(clmul_fold(x0, fold128), x3);
+
+	while (len >= 16) {
+		x0 = _mm_xor_si128(clmul_fold(x0, fold128), clmul_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *) buf, _mm_shuffle_epi8(x0, bswap));
+
+	crc = crc64_slice16(0, buf, sizeof(buf));
+	return crc64_slice16(crc, data, len);
+}
+#endif
+
+static bool always_supported(void)
+{
+	return true;
+}
+
+const struct crc64_impl crc64_impls[] = {
+	{ "bytewise",	crc64_bytewise,	always_supported },
+	{ "slice16",	crc64_slice16,	always_supported },
+#ifdef HAVE_CRC64_CLMUL
+	{ "clmul",	crc64_clmul,	clmul_supported },
+#endif
+	{ NULL,		NULL,		NULL },
+};
+
+uint64_t crc64_update(uint64_t crc, const void *_data, size_t len)
+{
+	return crc64_update_fn(crc, _data, len);
+}
+
+/*
+ * Appending B to A multiplies A's register by x^(8 * len(B)); the all-ones
+ * initial value and final inversion cancel out of the cross terms, so this
+ * works directly on finished crcs.
+ */
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, size_t len2)
+{
+	return gf2_mulmod(crc1, xpow_mod(8 * (uint64_t) len2)) ^ crc2;
+}
+
+uint64_t crc64(const void *_data, size_t len)
+{
+	return crc64_final(crc64_update(crc64_init(), _data, len));
+}
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+void cache_sb_decode(const struct cache_sb *sb, struct cache_sb_info *info)
+{
+	static const char * const replacement[] = {
+		[CACHE_REPLACEMENT_LRU]		= "lru",
+		[CACHE_REPLACEMENT_FIFO]	= "fifo",
+		[CACHE_REPLACEMENT_RANDOM]	= "random",
+	};
+	static const char * const cache_mode[] = {
+		[CACHE_MODE_WRITETHROUGH]	= "writethrough",
+		[CACHE_MODE_WRITEBACK]		= "writeback",
+		[CACHE_MODE_WRITEAROUND]	= "writearound",
+		[CACHE_MODE_NONE]		= "no caching",
+	};
+	static const char * const state[] = {
+		[BDEV_STATE_NONE]		= "detached",
+		[BDEV_STATE_CLEAN]		= "clean",
+		[BDEV_STATE_DIRTY]		= "dirty",
+		[BDEV_STATE_STALE]		= "inconsistent",
+	};
+
+	memset(info, 0, sizeof(*info));
+
+	info->magic_ok	= !memcmp(sb->magic, bcache_magic, 16);
+	info->offset_ok	= sb->offset == SB_SECTOR;
+	if (sb->keys <= SB_JOURNAL_BUCKETS) {
+		info->expected_csum = csum_set(sb);
+		info->csum_ok = sb->csum == info->expected_csum;
+	}
+
+	switch (sb->version) {
+	/* These are handled the same by the kernel */
+	case BCACHE_SB_VERSION_CDEV:
+	case BCACHE_SB_VERSION_CDEV_WITH_UUID:
+	case BCACHE_SB_VERSION_CDEV_WITH_FEATURES:
+		info->version = "cache device";
+		break;
+	/* The second adds data offset support */
+	case BCACHE_SB_VERSION_BDEV:
+	case BCACHE_SB_VERSION_BDEV_WITH_OFFSET:
+	case BCACHE_SB_VERSION_BDEV_WITH_FEATURES:
+		info->version = "backing device";
+		info->bdev = true;
+		break;
+	}
+
+	memcpy(info->label, sb->label, SB_LABEL_SIZE);
+
+	info->bucket_size = cache_sb_bucket_size(sb);
+	info->unknown_features = SB_HAS_FEATURES(sb) &&
+		((sb->feature_incompat & ~BCH_FEATURE_INCOMPAT_SUPP) ||
+		 (sb->feature_ro_compat & ~BCH_FEATURE_RO_COMPAT_SUPP));
+
+	if (!info->version)
+		return;
+
+	if (!info->bdev) {
+		info->first_sector = info->bucket_size * sb->first_bucket;
+		info->cache_sectors = info->bucket_size *
+			(sb->nbuckets - sb->first_bucket);
+		info->total_sectors = info->bucket_size * sb->nbuckets;
+		if (CACHE_REPLACEMENT(sb) < ARRAY_SIZE(replacement))
+			info->replacement = replacement[CACHE_REPLACEMENT(sb)];
+
+		/* the kernel insists on buckets following first_bucket */
+		if (sb->keys <= SB_JOURNAL_BUCKETS) {
+			unsigned i;
+
+			info->journal_ok = true;
+			for (i = 0; i < sb->keys; i++)
+				if (sb->d[i] != sb->first_bucket + i)
+					info->journal_ok = false;
+		}
+	} else {
+		if (sb->version == BCACHE_SB_VERSION_BDEV) {
+			info->first_sector = BDEV_DATA_START_DEFAULT;
+		} else {
+			info->experimental = sb->keys == 1 || sb->d[0];
+			info->first_sector = sb->data_offset;
+		}
+		if (BDEV_CACHE_MODE(sb) < ARRAY_SIZE(cache_mode))
+			info->cache_mode = cache_mode[BDEV_CACHE_MODE(sb)];
+		info->state = state[BDEV_STATE(sb)];
+	}
+}
+
+bool cache_sb_valid(const struct cache_sb *sb)
+{
+	return !memcmp(sb->magic, bcache_magic, 16) &&
+		sb->offset == SB_SECTOR &&
+		sb->keys <= SB_JOURNAL_BUCKETS &&
+		sb->csum == csum_set(sb);
+}
+
+int bcache_register_line(const char *sysfs, const char *line, size_t len)
+{
+	ssize_t r;
+	int fd, ret = 0;
+
+	fd = open(sysfs, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	/* sysfs takes the whole line in one write or not at all */
+	r = write(fd, line, len);
+	if (r < 0)
+		ret = -errno;
+	else if (r != len)
+		ret = -EIO;
+
+	close(fd);
+	return ret;
+}
+
+int bcache_register(const char *sysfs, const char *dev)
+{
+	char line[PATH_MAX + 1];
+	int len = snprintf(line, sizeof(line), "%s\n", dev);
+
+	if (len >= sizeof(line))
+		return -ENAMETOOLONG;
+
+	return bcache_register_line(sysfs, line, len);
 }
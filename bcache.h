@@ -27,16 +27,21 @@ static const char bcache_magic[] = {
  * Version 2: Seed pointer into btree node checksum
  * Version 3: Cache device with new UUID format
  * Version 4: Backing device with data offset
+ * Version 5: Cache device with feature flags
+ * Version 6: Backing device with data offset and feature flags
  */
 #define BCACHE_SB_VERSION_CDEV			0
 #define BCACHE_SB_VERSION_BDEV			1
 #define BCACHE_SB_VERSION_CDEV_WITH_UUID	3
 #define BCACHE_SB_VERSION_BDEV_WITH_OFFSET	4
-#define BCACHE_SB_MAX_VERSION			4
+#define BCACHE_SB_VERSION_CDEV_WITH_FEATURES	5
+#define BCACHE_SB_VERSION_BDEV_WITH_FEATURES	6
+#define BCACHE_SB_MAX_VERSION			6
 
 #define SB_SECTOR		8
 #define SB_LABEL_SIZE		32
 #define SB_JOURNAL_BUCKETS	256U
+#define MAX_CACHES_PER_SET	8
 #define BDEV_DATA_START_DEFAULT	16	/* sectors */
 #define SB_START		(SB_SECTOR * 512)
 
@@ -56,7 +61,12 @@ struct cache_sb {
 
 	uint64_t		flags;
 	uint64_t		seq;
-	uint64_t		pad[8];
+
+	/* only meaningful from BCACHE_SB_VERSION_CDEV_WITH_FEATURES on */
+	uint64_t		feature_compat;
+	uint64_t		feature_incompat;
+	uint64_t		feature_ro_compat;
+	uint64_t		pad[5];
 
 	union {
 	struct {
@@ -89,12 +99,71 @@ struct cache_sb {
 		uint16_t	keys;
 	};
 	uint64_t		d[SB_JOURNAL_BUCKETS];	/* journal buckets */
+	uint16_t		obso_bucket_size_hi;	/* obsoleted */
 };
 
 static inline bool SB_IS_BDEV(const struct cache_sb *sb)
 {
 	return sb->version == BCACHE_SB_VERSION_BDEV
-		|| sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
+		|| sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET
+		|| sb->version == BCACHE_SB_VERSION_BDEV_WITH_FEATURES;
+}
+
+/*
+ * Feature flags, as in the kernel: a kernel that finds an incompat bit it
+ * doesn't know refuses the device, ro_compat bits only allow it read only.
+ */
+#define BCH_FEATURE_COMPAT_SUPP		0ULL
+#define BCH_FEATURE_RO_COMPAT_SUPP	0ULL
+
+/* 32 bit bucket size in bucket_size and obso_bucket_size_hi; obsoleted */
+#define BCH_FEATURE_INCOMPAT_OBSO_LARGE_BUCKET		0x0001ULL
+/* bucket_size holds log2 of the bucket size in sectors */
+#define BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE	0x0002ULL
+
+#define BCH_FEATURE_INCOMPAT_SUPP	(BCH_FEATURE_INCOMPAT_OBSO_LARGE_BUCKET| \
+					 BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE)
+
+static inline bool SB_HAS_FEATURES(const struct cache_sb *sb)
+{
+	return sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES;
+}
+
+/* Bucket size in sectors, however the superblock stores it; 0 if bogus */
+static inline uint64_t cache_sb_bucket_size(const struct cache_sb *sb)
+{
+	if (SB_HAS_FEATURES(sb)) {
+		if (sb->feature_incompat &
+		    BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE)
+			return sb->bucket_size < 32
+				? 1ULL << sb->bucket_size : 0;
+		if (sb->feature_incompat &
+		    BCH_FEATURE_INCOMPAT_OBSO_LARGE_BUCKET)
+			return sb->bucket_size +
+				((uint64_t) sb->obso_bucket_size_hi << 16);
+	}
+	return sb->bucket_size;
+}
+
+/*
+ * Buckets beyond what 16 bits of sectors hold need the feature superblock;
+ * @sectors must then be a power of two.  Set the version and data_offset
+ * first: this only ever moves the version up to the matching
+ * _WITH_FEATURES one.
+ */
+static inline void cache_sb_set_bucket_size(struct cache_sb *sb,
+					    uint64_t sectors)
+{
+	if (sectors <= UINT16_MAX) {
+		sb->bucket_size = sectors;
+		return;
+	}
+
+	sb->version = SB_IS_BDEV(sb)
+		? BCACHE_SB_VERSION_BDEV_WITH_FEATURES
+		: BCACHE_SB_VERSION_CDEV_WITH_FEATURES;
+	sb->feature_incompat |= BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE;
+	sb->bucket_size = __builtin_ctzll(sectors);
 }
 
 BITMASK(CACHE_SYNC,		struct cache_sb, flags, 0, 1);
@@ -115,12 +184,107 @@ BITMASK(BDEV_STATE,		struct cache_sb, flags, 61, 2);
 #define BDEV_STATE_DIRTY	2U
 #define BDEV_STATE_STALE	3U
 
+/*
+ * crc64 (ECMA-182 polynomial, all-ones init and final xor) in one go, or
+ * incrementally:
+ *
+ *	crc = crc64_init();
+ *	crc = crc64_update(crc, buf1, len1);
+ *	crc = crc64_update(crc, buf2, len2);
+ *	crc = crc64_final(crc);
+ *
+ * crc64_combine() returns crc64(A + B) given crc64(A), crc64(B) and the
+ * length of B, so separate pieces of a buffer can be hashed independently.
+ */
 uint64_t crc64(const void *_data, size_t len);
+uint64_t crc64_update(uint64_t crc, const void *_data, size_t len);
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, size_t len2);
+
+static inline uint64_t crc64_init(void)
+{
+	return 0xFFFFFFFFFFFFFFFFULL;
+}
+
+static inline uint64_t crc64_final(uint64_t crc)
+{
+	return crc ^ 0xFFFFFFFFFFFFFFFFULL;
+}
+
+/*
+ * Every crc64_update() implementation built in, for benchmarking and
+ * cross-checking; terminated by a NULL name.  Only call update() if
+ * supported() returns true on this cpu.
+ */
+struct crc64_impl {
+	const char	*name;
+	uint64_t	(*update)(uint64_t crc, const unsigned char *data,
+				  size_t len);
+	bool		(*supported)(void);
+};
+
+extern const struct crc64_impl crc64_impls[];
 
 #define node(i, j)		((void *) ((i)->d + (j)))
 #define end(i)			node(i, (i)->keys)
 
 #define csum_set(i)							\
-	crc64(((void *) (i)) + 8, ((void *) end(i)) - (((void *) (i)) + 8))
+	crc64_final(crc64_update(crc64_init(), ((void *) (i)) + 8,	\
+				 ((void *) end(i)) - (((void *) (i)) + 8)))
+
+/*
+ * A superblock checked and decoded field by field, shared by the tools that
+ * show superblocks.  Decoding never trusts the superblock: keys is checked
+ * before computing the csum (which covers d[keys]), and anything we can't
+ * name comes back as NULL.
+ */
+struct cache_sb_info {
+	bool		magic_ok;
+	bool		offset_ok;
+	bool		csum_ok;
+	uint64_t	expected_csum;	/* 0 if keys is out of range */
+
+	const char	*version;	/* "cache device" or "backing device" */
+	bool		bdev;
+	/* a backing device with journal keys, which we don't understand */
+	bool		experimental;
+
+	char		label[SB_LABEL_SIZE + 1];
+
+	uint64_t	bucket_size;	/* sectors, decoded */
+	/* incompat or ro_compat features we (and likely the kernel) don't know */
+	bool		unknown_features;
+
+	/* cache: first bucket; backing: start of the data */
+	uint64_t	first_sector;
+	uint64_t	cache_sectors;	/* cache only */
+	uint64_t	total_sectors;	/* cache only, includes the superblock */
+
+	const char	*replacement;	/* cache only */
+	/* cache only: keys journal buckets, laid out from first_bucket on */
+	bool		journal_ok;
+	const char	*cache_mode;	/* backing only */
+	const char	*state;		/* backing only */
+};
+
+void cache_sb_decode(const struct cache_sb *sb, struct cache_sb_info *info);
+
+/* Magic, location and checksum all check out */
+bool cache_sb_valid(const struct cache_sb *sb);
+
+#define BCACHE_REGISTER_PATH	"/sys/fs/bcache/register"
+
+/*
+ * Ask the kernel to register @dev by writing it to @sysfs (normally
+ * BCACHE_REGISTER_PATH).  Returns 0 or -errno; -ENOENT usually means the
+ * bcache module isn't loaded.
+ */
+int bcache_register(const char *sysfs, const char *dev);
+
+/*
+ * The same with the line to write ("dev\n") already formatted: only open(),
+ * write() and close(), so it's safe in a child forked from a threaded
+ * process.
+ */
+int bcache_register_line(const char *sysfs, const char *line, size_t len);
 
 #endif
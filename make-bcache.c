@@ -6,7 +6,8 @@
 
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <blkid.h>
 #include <ctype.h>
@@ -14,13 +15,18 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <linux/blkzoned.h>
 #include <linux/fs.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -34,21 +40,27 @@
 	(void) (&_max1 == &_max2);		\
 	_max1 > _max2 ? _max1 : _max2; })
 
-uint64_t getblocks(int fd)
+#define min(x, y) ({				\
+	typeof(x) _min1 = (x);			\
+	typeof(y) _min2 = (y);			\
+	(void) (&_min1 == &_min2);		\
+	_min1 < _min2 ? _min1 : _min2; })
+
+static int getblocks(int fd, uint64_t *ret)
 {
-	uint64_t ret;
 	struct stat statbuf;
-	if (fstat(fd, &statbuf)) {
-		perror("stat error\n");
-		exit(EXIT_FAILURE);
+	unsigned long size;
+
+	if (fstat(fd, &statbuf))
+		return -1;
+
+	*ret = statbuf.st_size / 512;
+	if (S_ISBLK(statbuf.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE, &size))
+			return -1;
+		*ret = size;
 	}
-	ret = statbuf.st_size / 512;
-	if (S_ISBLK(statbuf.st_mode))
-		if (ioctl(fd, BLKGETSIZE, &ret)) {
-			perror("ioctl error");
-			exit(EXIT_FAILURE);
-		}
-	return ret;
+	return 0;
 }
 
 uint64_t hatoi(const char *s)
@@ -72,7 +84,13 @@ uint64_t hatoi(const char *s)
 	return i;
 }
 
-unsigned hatoi_validate(const char *s, const char *msg)
+/*
+ * Buckets past 65535 sectors need the feature superblock (and a kernel that
+ * understands it); past 2 GiB the kernel's bucket byte counts overflow
+ */
+#define BUCKET_SIZE_MAX	(1U << 22)
+
+unsigned hatoi_validate(const char *s, const char *msg, unsigned max)
 {
 	uint64_t v = hatoi(s);
 
@@ -83,7 +101,7 @@ unsigned hatoi_validate(const char *s, const char *msg)
 
 	v /= 512;
 
-	if (v > USHRT_MAX) {
+	if (v > max) {
 		fprintf(stderr, "%s too large\n", msg);
 		exit(EXIT_FAILURE);
 	}
@@ -146,16 +164,34 @@ void usage()
 {
 	fprintf(stderr,
 		   "Usage: make-bcache [options] device\n"
-	       "	-C, --cache		Format a cache device\n"
+	       "	-C, --cache		Format a cache device; several make up\n"
+	       "				one cache set\n"
 	       "	-B, --bdev		Format a backing device\n"
-	       "	-b, --bucket		bucket size\n"
+	       "	-b, --bucket		bucket size (up to 2G; over 32M needs the\n"
+	       "				large_bucket feature), or auto to pick\n"
+	       "				one from the device's I/O limits\n"
+	       "	    --bucket-sweep	with --bucket=auto, also time writes at\n"
+	       "				each candidate size\n"
 	       "	-w, --block		block size (hard sector size of SSD, often 2k)\n"
-	       "	-o, --data-offset	data offset in sectors\n"
+	       "	    --journal-size	journal layout hint: this size after the\n"
+	       "				first bucket (mainline kernels ignore it\n"
+	       "				and use their own choice)\n"
+	       "	    --emulate-zones	size[,capacity]: format as if the device\n"
+	       "				were zoned, for testing\n"
+	       "	-o, --data-offset	data offset in sectors (default: aligned\n"
+	       "				to the RAID stripe, if any)\n"
 	       "	    --cset-uuid		UUID for the cache set\n"
+	       "	-l, --label		label to store in the superblock\n"
+	       "	-m, --manifest		format the cache sets described in a file\n"
 //	       "	-U			UUID\n"
 	       "	    --writeback		enable writeback\n"
 	       "	    --discard		enable discards\n"
+	       "	    --discard-device	discard the whole cache before formatting\n"
 	       "	    --cache_replacement_policy=(lru|fifo)\n"
+	       "	    --plan		show the layout and kernel memory use of\n"
+	       "				cache devices per bucket size; don't format\n"
+	       "	-j, --jobs		format up to this many devices at once\n"
+	       "				(0: all of them)\n"
 	       "	-h, --help		display this help and exit\n");
 	exit(EXIT_FAILURE);
 }
@@ -167,72 +203,773 @@ const char * const cache_replacement_policies[] = {
 	NULL
 };
 
-static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
-		     bool writeback, bool discard, bool wipe_bcache,
-		     unsigned cache_replacement_policy,
-		     uint64_t data_offset,
-		     uuid_t set_uuid, bool bdev)
+const char * const cache_modes[] = {
+	"writethrough",
+	"writeback",
+	"writearound",
+	"none",
+	NULL
+};
+
+/*
+ * One device to format: the parameters to write, and what happened.  Jobs
+ * are independent of each other, so several can run at once; messages go
+ * to job->out and job->err, which in parallel mode are buffers printed
+ * in order once everything is done.
+ */
+struct format_job {
+	char		*dev;
+	bool		bdev;
+	unsigned	block_size;
+	unsigned	bucket_size;
+	bool		bucket_given;
+	unsigned	cache_mode;
+	bool		discard;
+	bool		trim;
+	bool		bucket_sweep;
+	bool		wipe_bcache;
+	unsigned	cache_replacement_policy;
+	uint64_t	data_offset;
+	uuid_t		set_uuid;
+	unsigned	nr_in_set;	/* cache devices in the set */
+	unsigned	nr_this_dev;
+	uint64_t	journal_size;	/* bytes; 0 leaves it to the kernel */
+	/* --emulate-zones, in sectors */
+	uint64_t	emulate_zone_size, emulate_zone_capacity;
+	char		label[SB_LABEL_SIZE];
+
+	FILE		*out, *err;
+	char		*out_buf, *err_buf;
+	size_t		out_len, err_len;
+
+	int		ret;
+	uint64_t	probe_ns, trim_ns, write_ns, sync_ns;
+};
+
+static uint64_t now_ns(void)
 {
-	int fd;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define TRIM_CHUNK	(1ULL << 30)
+#define TRIM_THREADS	4
+
+enum trim_method {
+	TRIM_ZONE_RESET,
+	TRIM_DISCARD,
+	TRIM_SECDISCARD,
+	TRIM_ZEROOUT,
+	TRIM_PUNCH_HOLE,
+};
+
+static const char * const trim_methods[] = {
+	"BLKRESETZONE",
+	"BLKDISCARD",
+	"BLKSECDISCARD",
+	"BLKZEROOUT",
+	"punch hole",
+};
+
+struct trim {
+	int		fd;
+	enum trim_method method;
+	uint64_t	end, chunk;	/* bytes */
+	uint64_t	next, done;
+	unsigned	running;
+	int		err;
+};
+
+static int trim_range(int fd, enum trim_method method,
+		      uint64_t start, uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+	struct blk_zone_range zones = { start >> 9, len >> 9 };
+
+	switch (method) {
+	case TRIM_ZONE_RESET:
+		return ioctl(fd, BLKRESETZONE, &zones);
+	case TRIM_DISCARD:
+		return ioctl(fd, BLKDISCARD, range);
+	case TRIM_SECDISCARD:
+		return ioctl(fd, BLKSECDISCARD, range);
+	case TRIM_ZEROOUT:
+		return ioctl(fd, BLKZEROOUT, range);
+	case TRIM_PUNCH_HOLE:
+		return fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+				 start, len);
+	}
+	return -1;
+}
+
+static void *trim_worker(void *arg)
+{
+	struct trim *t = arg;
+	uint64_t start, len;
+
+	while (!t->err &&
+	       (start = __sync_fetch_and_add(&t->next, t->chunk)) < t->end) {
+		len = t->end - start < t->chunk ? t->end - start : t->chunk;
+
+		if (trim_range(t->fd, t->method, start, len)) {
+			t->err = errno;
+			break;
+		}
+
+		__sync_fetch_and_add(&t->done, len);
+	}
+
+	__sync_fetch_and_sub(&t->running, 1);
+	return NULL;
+}
+
+/*
+ * Throw away everything in [start, end) so a recycled SSD starts with an
+ * empty FTL: BLKDISCARD if the device supports it, else BLKSECDISCARD, else
+ * BLKZEROOUT; zoned devices get their zones reset, regular files get holes
+ * punched instead.  The first chunk is done synchronously to find a method
+ * that works, the rest is split into bucket aligned chunks issued from
+ * several threads.
+ */
+static int trim_dev(struct format_job *j, int fd, uint64_t start,
+		    uint64_t end, uint64_t align)
+{
+	struct trim t = { .fd = fd, .end = end };
+	pthread_t threads[TRIM_THREADS];
+	struct stat statbuf;
+	uint64_t begin = now_ns(), len, elapsed;
+	bool progress = j->err == stderr && isatty(STDERR_FILENO);
+	unsigned i, nr_threads = 0, zone_size = 0;
+
+	if (fstat(fd, &statbuf))
+		return -1;
+
+	t.chunk = TRIM_CHUNK - TRIM_CHUNK % align;
+	if (!t.chunk)
+		t.chunk = align;
+
+	len = end - start < t.chunk ? end - start : t.chunk;
+
+	if (S_ISBLK(statbuf.st_mode) && ioctl(fd, BLKGETZONESZ, &zone_size))
+		zone_size = 0;
+
+	for (t.method = !S_ISBLK(statbuf.st_mode) ? TRIM_PUNCH_HOLE
+			: zone_size ? TRIM_ZONE_RESET : TRIM_DISCARD;
+	     trim_range(fd, t.method, start, len);
+	     t.method++)
+		if (t.method == TRIM_ZEROOUT || t.method == TRIM_PUNCH_HOLE) {
+			fprintf(j->err, "Can't discard %s: %s\n",
+				j->dev, strerror(errno));
+			return -1;
+		}
+
+	t.next = start + len;
+	t.done = len;
+
+	for (i = 0; i < TRIM_THREADS && t.next < end; i++) {
+		__sync_fetch_and_add(&t.running, 1);
+		if (pthread_create(&threads[i], NULL, trim_worker, &t)) {
+			__sync_fetch_and_sub(&t.running, 1);
+			break;
+		}
+		nr_threads++;
+	}
+
+	if (!nr_threads && t.next < end) {
+		/* couldn't start any threads, do it here */
+		t.running = 1;
+		trim_worker(&t);
+	}
+
+	while (t.running) {
+		if (progress) {
+			fprintf(stderr, "\rDiscarding %s: %3u%%", j->dev,
+				(unsigned) (t.done * 100 / (end - start)));
+			fflush(stderr);
+		}
+		usleep(250 * 1000);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (progress)
+		fprintf(stderr, "\r\033[K");
+
+	if (t.err) {
+		fprintf(j->err, "%s failed on %s: %s\n",
+			trim_methods[t.method], j->dev, strerror(t.err));
+		return -1;
+	}
+
+	elapsed = now_ns() - begin;
+	fprintf(j->out, "discarded:		%ju MiB in %.2f s (%.0f MB/s, %s)\n",
+		t.done >> 20, elapsed / 1e9,
+		elapsed ? t.done * 1e3 / elapsed : 0.0,
+		trim_methods[t.method]);
+
+	return 0;
+}
+
+#define MIN_BUCKETS	(1 << 7)
+
+/* Where buckets go on a cache device of @blocks sectors */
+static void cache_layout(struct cache_sb *sb, uint64_t blocks)
+{
+	uint64_t bucket_size = cache_sb_bucket_size(sb);
+
+	sb->nbuckets		= blocks / bucket_size;
+	sb->nr_in_set		= 1;
+	sb->first_bucket	= (23 / bucket_size) + 1;
+}
+
+struct io_limits {
+	unsigned	logical_block_size;	/* bytes */
+	unsigned	physical_block_size;
+	unsigned	minimum_io_size;
+	unsigned	optimal_io_size;
+	unsigned	discard_granularity;
+	int		alignment_offset;
+	bool		rotational;
+};
+
+static unsigned long read_queue_attr(dev_t dev, const char *attr)
+{
+	char path[PATH_MAX];
+	unsigned long v = 0;
+	FILE *f;
+
+	/* partitions don't have a queue directory, their parent does */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s",
+		 major(dev), minor(dev), attr);
+	if (!(f = fopen(path, "r"))) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s",
+			 major(dev), minor(dev), attr);
+		if (!(f = fopen(path, "r")))
+			return 0;
+	}
+
+	if (fscanf(f, "%lu", &v) != 1)
+		v = 0;
+	fclose(f);
+	return v;
+}
+
+/*
+ * Device I/O topology, from the BLK* ioctls and the queue attributes in
+ * sysfs.  Anything unknown is left at 0; regular files report only their
+ * st_blksize as the logical block size.
+ */
+static void get_io_limits(int fd, struct io_limits *l)
+{
+	struct stat statbuf;
+	int v;
+
+	memset(l, 0, sizeof(*l));
+
+	if (fstat(fd, &statbuf))
+		return;
+
+	if (!S_ISBLK(statbuf.st_mode)) {
+		l->logical_block_size = statbuf.st_blksize;
+		return;
+	}
+
+	if (!ioctl(fd, BLKSSZGET, &v))
+		l->logical_block_size = v;
+	if (!ioctl(fd, BLKPBSZGET, &v))
+		l->physical_block_size = v;
+	if (!ioctl(fd, BLKIOMIN, &v))
+		l->minimum_io_size = v;
+	if (!ioctl(fd, BLKIOOPT, &v))
+		l->optimal_io_size = v;
+	if (!ioctl(fd, BLKALIGNOFF, &v))
+		l->alignment_offset = v;
+
+	l->discard_granularity	= read_queue_attr(statbuf.st_rdev,
+						  "discard_granularity");
+	l->rotational		= read_queue_attr(statbuf.st_rdev,
+						  "rotational");
+}
+
+/*
+ * Zone geometry of a zoned (host-managed/host-aware SMR, or ZNS) device,
+ * from BLKGETZONESZ, BLKGETNRZONES and a walk over BLKREPORTZONE; or made
+ * up from --emulate-zones, which treats any device or file as zoned with a
+ * conventional first zone so the checks below can be tried anywhere.
+ * zone_size is 0 for ordinary devices.
+ */
+struct zone_geometry {
+	uint64_t	zone_size;	/* sectors */
+	uint64_t	capacity;	/* smallest of the sequential zones' */
+	uint64_t	nr_zones;
+	unsigned	nr_conv;	/* conventional zones at the start */
+	bool		emulated;
+};
+
+#define ZONE_REPORT_BATCH	256
+
+static int get_zone_geometry(struct format_job *j, int fd, uint64_t blocks,
+			     struct zone_geometry *z)
+{
+	struct blk_zone_report *r;
+	struct blk_zone *zone;
+	uint64_t sector = 0;
+	bool conv = true;
+	unsigned v, i;
+
+	memset(z, 0, sizeof(*z));
+
+	if (j->emulate_zone_size) {
+		z->zone_size	= j->emulate_zone_size;
+		z->capacity	= j->emulate_zone_capacity ?: z->zone_size;
+		z->nr_zones	= (blocks + z->zone_size - 1) / z->zone_size;
+		z->nr_conv	= 1;
+		z->emulated	= true;
+		return 0;
+	}
+
+	if (ioctl(fd, BLKGETZONESZ, &v) || !v)
+		return 0;
+	z->zone_size = z->capacity = v;
+
+	if (ioctl(fd, BLKGETNRZONES, &v))
+		return -1;
+	z->nr_zones = v;
+
+	r = calloc(1, sizeof(*r) + ZONE_REPORT_BATCH * sizeof(*zone));
+	if (!r)
+		return -1;
+
+	while (sector < blocks) {
+		r->sector	= sector;
+		r->nr_zones	= ZONE_REPORT_BATCH;
+
+		if (ioctl(fd, BLKREPORTZONE, r)) {
+			free(r);
+			return -1;
+		}
+		if (!r->nr_zones)
+			break;
+
+		for (i = 0; i < r->nr_zones; i++) {
+			zone = &r->zones[i];
+
+			if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+				z->nr_conv += conv;
+			} else {
+				conv = false;
+				/* the last zone may be a smaller runt */
+				if (zone->len == z->zone_size)
+					z->capacity = min(z->capacity,
+						(r->flags & BLK_ZONE_REP_CAPACITY)
+						? (uint64_t) zone->capacity
+						: (uint64_t) zone->len);
+			}
+			sector = zone->start + zone->len;
+		}
+	}
+
+	free(r);
+	return 0;
+}
+
+/* 0 if the result doesn't fit in 64 bits */
+static uint64_t roundup_pow_of_two(uint64_t v)
+{
+	if (v > 1ULL << 63)
+		return 0;
+	return v <= 1 ? 1 : 1ULL << (64 - __builtin_clzll(v - 1));
+}
+
+static void print_size(FILE *out, uint64_t bytes)
+{
+	if (bytes >= 1 << 20 && !(bytes & ((1 << 20) - 1)))
+		fprintf(out, "%juM", bytes >> 20);
+	else if (bytes >= 1 << 10 && !(bytes & ((1 << 10) - 1)))
+		fprintf(out, "%juk", bytes >> 10);
+	else
+		fprintf(out, "%ju", bytes);
+}
+
+#define AUTO_BUCKET_DEFAULT	1024U		/* sectors */
+#define AUTO_BUCKET_MAX		(1U << 15)	/* largest power of two in a u16 */
+#define SWEEP_MIN		(64U << 10)	/* bytes */
+#define SWEEP_MAX		(8U << 20)
+#define SWEEP_OFFSET		(16ULL << 20)
+#define SWEEP_BYTES		(32ULL << 20)
+
+/*
+ * Sequential write throughput (MB/s) in units of @size bytes, O_DIRECT if
+ * the device allows it.  This scribbles over the area we're about to
+ * format, after the checks for existing superblocks have passed.
+ */
+static double sweep_write(int fd, unsigned size)
+{
+	int flags = fcntl(fd, F_GETFL);
+	uint64_t off, start;
+	double mbps = 0;
+	unsigned i;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, size))
+		return 0;
+
+	for (i = 0; i < size; i++)
+		((unsigned char *) buf)[i] = random();
+
+	fcntl(fd, F_SETFL, flags|O_DIRECT);
+
+	start = now_ns();
+	for (off = 0; off < SWEEP_BYTES; off += size)
+		if (pwrite(fd, buf, size, SWEEP_OFFSET + off) != size)
+			goto out;
+
+	if (fdatasync(fd))
+		goto out;
+
+	mbps = SWEEP_BYTES * 1e3 / (now_ns() - start);
+out:
+	fcntl(fd, F_SETFL, flags);
+	free(buf);
+	return mbps;
+}
+
+/*
+ * Smallest bucket, in bytes, that respects the device's I/O granularity;
+ * capped at the largest automatic bucket size, which callers clamp to anyway
+ */
+static unsigned bucket_floor(const struct io_limits *l, unsigned block_size)
+{
+	uint64_t floor;
+
+	floor = max(l->physical_block_size, l->minimum_io_size);
+	floor = max(floor, (uint64_t) l->optimal_io_size);
+	floor = max(floor, (uint64_t) l->discard_granularity);
+	floor = max(floor, (uint64_t) block_size * 512);
+	return min(roundup_pow_of_two(floor), (uint64_t) AUTO_BUCKET_MAX * 512);
+}
+
+/*
+ * --bucket=auto: start from the old default, and raise it to the largest
+ * granularity the device says it cares about (physical block, minimum and
+ * optimal I/O size, discard granularity).  With --bucket-sweep, also time
+ * sequential writes at each candidate size and take the smallest one that
+ * gets within 90% of the best throughput: past that point bigger buckets
+ * cost allocation granularity without buying bandwidth.
+ */
+static int auto_bucket_size(struct format_job *j, int fd, uint64_t blocks)
+{
+	struct io_limits l;
+	unsigned floor, size, best_size = 0, chosen;
+	double mbps[32] = { 0 }, best = 0;
+	const char *why;
+	int n = 0;
+
+	get_io_limits(fd, &l);
+	floor = bucket_floor(&l, j->block_size);
+
+	fprintf(j->out, "io limits:		logical %u, physical %u, "
+		"io_min %u, io_opt %u, alignment_offset %i, "
+		"discard_granularity %u, rotational %u\n",
+		l.logical_block_size, l.physical_block_size,
+		l.minimum_io_size, l.optimal_io_size, l.alignment_offset,
+		l.discard_granularity, l.rotational);
+
+	chosen = max(floor, AUTO_BUCKET_DEFAULT * 512);
+	why = floor > AUTO_BUCKET_DEFAULT * 512
+		? "device I/O granularity"
+		: "default, larger than any device I/O granularity";
+
+	if (j->bucket_sweep && !l.rotational &&
+	    blocks * 512 >= SWEEP_OFFSET + SWEEP_BYTES) {
+		for (size = max(floor, SWEEP_MIN); size <= SWEEP_MAX; size <<= 1) {
+			mbps[n] = sweep_write(fd, size);
+			fprintf(j->out, "write sweep:		");
+			print_size(j->out, size);
+			fprintf(j->out, "\t%.1f MB/s\n", mbps[n]);
+			best = mbps[n] > best ? mbps[n] : best;
+			n++;
+		}
+
+		for (size = max(floor, SWEEP_MIN), n = 0;
+		     size <= SWEEP_MAX; size <<= 1, n++)
+			if (best && mbps[n] >= best * 0.9) {
+				best_size = size;
+				break;
+			}
+
+		if (best_size) {
+			chosen = best_size;
+			why = "smallest size within 90% of peak write throughput";
+		}
+	}
+
+	chosen = min(chosen / 512, AUTO_BUCKET_MAX);
+
+	fprintf(j->out, "bucket_size auto:	");
+	print_size(j->out, chosen * 512ULL);
+	fprintf(j->out, " (%s)\n", why);
+
+	j->bucket_size = chosen;
+	return 0;
+}
+
+/*
+ * On a zoned cache every bucket is exactly one zone: bucket reuse is then a
+ * single zone reset, never a partial zone rewrite.  That rules out zones
+ * bcache can't use whole: sizes that aren't a power of two or exceed the
+ * largest bucket, and zones whose capacity is smaller than their size
+ * (buckets can't have holes).  The last one excludes nearly every ZNS SSD:
+ * a bucket can't be sized to the capacity instead, as it has to be a power
+ * of two and buckets are laid out back to back.  The superblock is written
+ * in place, so the first zone must be conventional.
+ */
+static int zone_layout(struct format_job *j, int fd, uint64_t blocks)
+{
+	struct zone_geometry z;
+
+	if (get_zone_geometry(j, fd, blocks, &z)) {
+		fprintf(j->err, "Can't get the zones of %s: %s\n",
+			j->dev, strerror(errno));
+		return -1;
+	}
+
+	if (!z.zone_size)
+		return 0;
+
+	fprintf(j->out, "zones:			%ju x ", z.nr_zones);
+	print_size(j->out, z.zone_size * 512);
+	fprintf(j->out, ", capacity ");
+	print_size(j->out, z.capacity * 512);
+	fprintf(j->out, ", %u conventional%s\n", z.nr_conv,
+		z.emulated ? " (emulated)" : "");
+
+	if (j->bdev) {
+		fprintf(j->err, "%s is zoned; backing devices must take "
+			"random writes\n", j->dev);
+		return -1;
+	}
+
+	if (z.zone_size & (z.zone_size - 1) || z.zone_size > BUCKET_SIZE_MAX) {
+		fprintf(j->err, "Zone size of %s isn't a power of two up to ",
+			j->dev);
+		print_size(j->err, BUCKET_SIZE_MAX * 512ULL);
+		fputc('\n', j->err);
+		return -1;
+	}
+
+	if (z.capacity < z.zone_size) {
+		fprintf(j->err, "Zones of %s can only be written to %ju of "
+			"%ju sectors; bcache buckets can't skip the rest, so "
+			"zone capacity below zone size (as on most ZNS SSDs) "
+			"isn't supported\n",
+			j->dev, z.capacity, z.zone_size);
+		return -1;
+	}
+
+	if (!z.nr_conv) {
+		fprintf(j->err, "First zone of %s is sequential; the "
+			"superblock needs a conventional zone\n", j->dev);
+		return -1;
+	}
+
+	if (j->bucket_given && j->bucket_size != z.zone_size) {
+		fprintf(j->err, "Bucket size must be the zone size (");
+		print_size(j->err, z.zone_size * 512);
+		fprintf(j->err, ") on zoned device %s\n", j->dev);
+		return -1;
+	}
+
+	if (z.zone_size < j->block_size) {
+		fprintf(j->err, "Zones of %s are smaller than a block\n",
+			j->dev);
+		return -1;
+	}
+
+	j->bucket_size = z.zone_size;
+	return 0;
+}
+
+/*
+ * --journal-size is only a layout hint.  Journal buckets go right after
+ * first_bucket, which is the only place the kernel accepts them: as many as
+ * @journal_size takes, 2 to SB_JOURNAL_BUCKETS.  Mainline kernels ignore
+ * it: when a new cache set is first run they set keys to nbuckets / 128 in
+ * the same range and rewrite d[] to match, whatever we wrote.
+ */
+static int journal_layout(struct format_job *j, struct cache_sb *sb)
+{
+	uint64_t bucket_bytes = cache_sb_bucket_size(sb) * 512;
+	uint64_t n = (j->journal_size + bucket_bytes - 1) / bucket_bytes;
+	uint64_t kernel = sb->nbuckets >> 7;
+	unsigned i;
+
+	if (n < 2 || n > SB_JOURNAL_BUCKETS) {
+		fprintf(j->err, "Journal of %ju buckets on %s clamped to %u\n",
+			n, j->dev, n < 2 ? 2 : SB_JOURNAL_BUCKETS);
+		n = n < 2 ? 2 : SB_JOURNAL_BUCKETS;
+	}
+	kernel = min(max(kernel, (uint64_t) 2), (uint64_t) SB_JOURNAL_BUCKETS);
+
+	if (sb->first_bucket + n + MIN_BUCKETS > sb->nbuckets) {
+		fprintf(j->err, "Not enough buckets on %s for a journal of "
+			"%ju buckets\n", j->dev, n);
+		return -1;
+	}
+
+	sb->keys = n;
+	for (i = 0; i < n; i++)
+		sb->d[i] = sb->first_bucket + i;
+
+	fprintf(j->out, "journal:		%ju buckets, ", n);
+	print_size(j->out, n * bucket_bytes);
+	fprintf(j->out, " (layout hint; mainline kernels use %ju buckets)\n",
+		kernel);
+	return 0;
+}
+
+#define DATA_ALIGN_MAX		(64U << 20)	/* ignore io_opt beyond this */
+
+/*
+ * Default data offset for a backing device: line the start of the cached
+ * data up with the RAID stripe (optimal_io_size, or failing that the chunk
+ * size in minimum_io_size), so writeback I/O doesn't straddle stripes and
+ * turn into read-modify-write.  As with LVM's pe_start, alignment_offset is
+ * where the underlying storage's natural alignment starts.
+ */
+static uint64_t aligned_data_offset(struct format_job *j, int fd)
+{
+	struct io_limits l;
+	unsigned align = 0;
+	uint64_t offset;
+
+	get_io_limits(fd, &l);
+
+	if (l.optimal_io_size > BDEV_DATA_START_DEFAULT * 512 &&
+	    l.optimal_io_size <= DATA_ALIGN_MAX &&
+	    !(l.optimal_io_size % 512) &&
+	    (!l.minimum_io_size || !(l.optimal_io_size % l.minimum_io_size)))
+		align = l.optimal_io_size;
+	else if (l.minimum_io_size > BDEV_DATA_START_DEFAULT * 512 &&
+		 l.minimum_io_size <= DATA_ALIGN_MAX &&
+		 !(l.minimum_io_size % 512))
+		align = l.minimum_io_size;
+
+	if (!align || l.alignment_offset < 0 || l.alignment_offset % 512)
+		return BDEV_DATA_START_DEFAULT;
+
+	offset = l.alignment_offset % align;
+	while (offset < BDEV_DATA_START_DEFAULT * 512)
+		offset += align;
+
+	fprintf(j->out, "data alignment:		");
+	print_size(j->out, align);
+	fprintf(j->out, " (%s %u, alignment_offset %i)\n",
+		align == l.optimal_io_size ? "optimal_io_size" : "minimum_io_size",
+		align, l.alignment_offset);
+
+	return offset / 512;
+}
+
+static int write_sb(struct format_job *j)
+{
+	int fd, ret = -1;
 	char uuid_str[40], set_uuid_str[40], zeroes[SB_START] = {0};
 	struct cache_sb sb;
 	blkid_probe pr;
+	uint64_t start = now_ns(), blocks;
+	FILE *out = j->out, *err = j->err;
 
-	if ((fd = open(dev, O_RDWR|O_EXCL)) == -1) {
-		fprintf(stderr, "Can't open dev %s: %s\n", dev, strerror(errno));
-		exit(EXIT_FAILURE);
+	if ((fd = open(j->dev, O_RDWR|O_EXCL)) == -1) {
+		fprintf(err, "Can't open dev %s: %s\n", j->dev, strerror(errno));
+		return -1;
 	}
 
-	if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb))
-		exit(EXIT_FAILURE);
+	if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb)) {
+		fprintf(err, "Can't read %s\n", j->dev);
+		goto out;
+	}
 
-	if (!memcmp(sb.magic, bcache_magic, 16) && !wipe_bcache) {
-		fprintf(stderr, "Already a bcache device on %s, "
-			"overwrite with --wipe-bcache\n", dev);
-		exit(EXIT_FAILURE);
+	if (!memcmp(sb.magic, bcache_magic, 16) && !j->wipe_bcache) {
+		fprintf(err, "Already a bcache device on %s, "
+			"overwrite with --wipe-bcache\n", j->dev);
+		goto out;
 	}
 
 	if (!(pr = blkid_new_probe()))
-		exit(EXIT_FAILURE);
-	if (blkid_probe_set_device(pr, fd, 0, 0))
-		exit(EXIT_FAILURE);
-	/* enable ptable probing; superblock probing is enabled by default */
-	if (blkid_probe_enable_partitions(pr, true))
-		exit(EXIT_FAILURE);
+		goto out;
+	if (blkid_probe_set_device(pr, fd, 0, 0) ||
+	    /* enable ptable probing; superblock probing is enabled by default */
+	    blkid_probe_enable_partitions(pr, true)) {
+		blkid_free_probe(pr);
+		goto out;
+	}
 	if (!blkid_do_probe(pr)) {
 		/* XXX wipefs doesn't know how to remove partition tables */
-		fprintf(stderr, "Device %s already has a non-bcache superblock, "
-				"remove it using wipefs and wipefs -a\n", dev);
-		exit(EXIT_FAILURE);
+		fprintf(err, "Device %s already has a non-bcache superblock, "
+				"remove it using wipefs and wipefs -a\n", j->dev);
+		blkid_free_probe(pr);
+		goto out;
+	}
+	blkid_free_probe(pr);
+
+	if (getblocks(fd, &blocks)) {
+		fprintf(err, "Can't get size of %s: %s\n",
+			j->dev, strerror(errno));
+		goto out;
+	}
+
+	if (zone_layout(j, fd, blocks))
+		goto out;
+
+	if (!j->bucket_size) {
+		if (j->bdev)
+			j->bucket_size = AUTO_BUCKET_DEFAULT;
+		else if (auto_bucket_size(j, fd, blocks))
+			goto out;
+
+		if (j->bucket_size < j->block_size) {
+			fprintf(err, "Bucket size cannot be smaller than block size\n");
+			goto out;
+		}
 	}
 
 	memset(&sb, 0, sizeof(struct cache_sb));
 
 	sb.offset	= SB_SECTOR;
-	sb.version	= bdev
+	sb.version	= j->bdev
 		? BCACHE_SB_VERSION_BDEV
 		: BCACHE_SB_VERSION_CDEV;
 
 	memcpy(sb.magic, bcache_magic, 16);
 	uuid_generate(sb.uuid);
-	memcpy(sb.set_uuid, set_uuid, sizeof(sb.set_uuid));
+	memcpy(sb.set_uuid, j->set_uuid, sizeof(sb.set_uuid));
+	memcpy(sb.label, j->label, SB_LABEL_SIZE);
 
-	sb.bucket_size	= bucket_size;
-	sb.block_size	= block_size;
+	sb.block_size	= j->block_size;
 
 	uuid_unparse(sb.uuid, uuid_str);
 	uuid_unparse(sb.set_uuid, set_uuid_str);
 
 	if (SB_IS_BDEV(&sb)) {
-		SET_BDEV_CACHE_MODE(
-			&sb, writeback ? CACHE_MODE_WRITEBACK : CACHE_MODE_WRITETHROUGH);
+		SET_BDEV_CACHE_MODE(&sb, j->cache_mode);
+
+		if (!j->data_offset)
+			j->data_offset = aligned_data_offset(j, fd);
 
-		if (data_offset != BDEV_DATA_START_DEFAULT) {
+		if (j->data_offset != BDEV_DATA_START_DEFAULT) {
 			sb.version = BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
-			sb.data_offset = data_offset;
+			sb.data_offset = j->data_offset;
 		}
 
-		printf("UUID:			%s\n"
+		/* the bucket size only matters for the cache */
+		sb.bucket_size = min(j->bucket_size, (unsigned) USHRT_MAX);
+
+		fprintf(out,
+		       "UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
 		       "block_size:		%u\n"
@@ -240,22 +977,24 @@ static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
 		       uuid_str, set_uuid_str,
 		       (unsigned) sb.version,
 		       sb.block_size,
-		       data_offset);
+		       j->data_offset);
 	} else {
-		sb.nbuckets		= getblocks(fd) / sb.bucket_size;
-		sb.nr_in_set		= 1;
-		sb.first_bucket		= (23 / sb.bucket_size) + 1;
+		cache_sb_set_bucket_size(&sb, j->bucket_size);
+		cache_layout(&sb, blocks);
+		sb.nr_in_set	= j->nr_in_set;
+		sb.nr_this_dev	= j->nr_this_dev;
 
-		if (sb.nbuckets < 1 << 7) {
-			fprintf(stderr, "Not enough buckets: %ju, need %u\n",
-			       sb.nbuckets, 1 << 7);
-			exit(EXIT_FAILURE);
+		if (sb.nbuckets < MIN_BUCKETS) {
+			fprintf(err, "Not enough buckets on %s: %ju, need %u\n",
+			       j->dev, sb.nbuckets, MIN_BUCKETS);
+			goto out;
 		}
 
-		SET_CACHE_DISCARD(&sb, discard);
-		SET_CACHE_REPLACEMENT(&sb, cache_replacement_policy);
+		SET_CACHE_DISCARD(&sb, j->discard);
+		SET_CACHE_REPLACEMENT(&sb, j->cache_replacement_policy);
 
-		printf("UUID:			%s\n"
+		fprintf(out,
+		       "UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
 		       "nbuckets:		%ju\n"
@@ -268,27 +1007,390 @@ static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
 		       (unsigned) sb.version,
 		       sb.nbuckets,
 		       sb.block_size,
-		       sb.bucket_size,
+		       j->bucket_size,
 		       sb.nr_in_set,
 		       sb.nr_this_dev,
 		       sb.first_bucket);
+
+		if (sb.feature_incompat &
+		    BCH_FEATURE_INCOMPAT_LOG_LARGE_BUCKET_SIZE)
+			fprintf(out, "features:		large_bucket "
+				"(incompat, needs kernel support)\n");
+
+		if (j->journal_size && journal_layout(j, &sb))
+			goto out;
 	}
 
+	if (*j->label)
+		fprintf(out, "label:			%.*s\n",
+			SB_LABEL_SIZE, j->label);
+
 	sb.csum = csum_set(&sb);
 
+	j->probe_ns = now_ns() - start;
+	start = now_ns();
+
+	if (!SB_IS_BDEV(&sb) && j->trim) {
+		if (trim_dev(j, fd, j->bucket_size * sb.first_bucket * 512ULL,
+			     j->bucket_size * sb.nbuckets * 512ULL,
+			     j->bucket_size * 512ULL))
+			goto out;
+
+		j->trim_ns = now_ns() - start;
+		start = now_ns();
+	}
+
 	/* Zero start of disk */
 	if (pwrite(fd, zeroes, SB_START, 0) != SB_START) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+		fprintf(err, "write error on %s: %s\n", j->dev, strerror(errno));
+		goto out;
 	}
 	/* Write superblock */
 	if (pwrite(fd, &sb, sizeof(sb), SB_START) != sizeof(sb)) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+		fprintf(err, "write error on %s: %s\n", j->dev, strerror(errno));
+		goto out;
+	}
+
+	j->write_ns = now_ns() - start;
+	start = now_ns();
+
+	if (fsync(fd)) {
+		fprintf(err, "fsync error on %s: %s\n", j->dev, strerror(errno));
+		goto out;
+	}
+
+	j->sync_ns = now_ns() - start;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Cache devices sharing a set uuid are the members of one cache set: number
+ * them in order and make sure they can work together.  The kernel indexes
+ * the set's caches by nr_this_dev and insists they all have the same block
+ * and bucket size, since pointers into any of them share one btree.
+ *
+ * The automatic bucket size is worked out per device, so for a set of more
+ * than one cache we settle it here instead: the largest I/O granularity of
+ * any member, without the write sweep (this runs before the checks for
+ * existing superblocks).
+ */
+static int number_set_members(struct format_job *jobs, unsigned nr)
+{
+	unsigned i, k, n, bucket_size, floor;
+	struct io_limits l;
+	char uuid_str[40];
+	int fd;
+
+	for (i = 0; i < nr; i++) {
+		struct format_job *j = &jobs[i];
+
+		if (j->bdev || j->nr_in_set)
+			continue;
+
+		n = bucket_size = 0;
+		for (k = i; k < nr; k++) {
+			struct format_job *m = &jobs[k];
+
+			if (m->bdev || uuid_compare(m->set_uuid, j->set_uuid))
+				continue;
+
+			if (m->block_size != j->block_size) {
+				fprintf(stderr, "Cache devices %s and %s of one "
+					"set have different block sizes\n",
+					j->dev, m->dev);
+				return -1;
+			}
+
+			if (m->bucket_size && bucket_size &&
+			    m->bucket_size != bucket_size) {
+				fprintf(stderr, "Cache devices of one set must "
+					"have the same bucket size (%s)\n",
+					m->dev);
+				return -1;
+			}
+			bucket_size = m->bucket_size ?: bucket_size;
+
+			m->nr_this_dev = n++;
+		}
+
+		uuid_unparse(j->set_uuid, uuid_str);
+
+		if (n > MAX_CACHES_PER_SET) {
+			fprintf(stderr, "Set %s has %u cache devices, "
+				"at most %u are supported\n",
+				uuid_str, n, MAX_CACHES_PER_SET);
+			return -1;
+		}
+
+		if (n > 1 && !bucket_size) {
+			floor = 0;
+			for (k = i; k < nr; k++) {
+				struct format_job *m = &jobs[k];
+
+				if (m->bdev ||
+				    uuid_compare(m->set_uuid, j->set_uuid))
+					continue;
+
+				if ((fd = open(m->dev, O_RDONLY)) < 0) {
+					fprintf(stderr, "Can't open dev %s: %s\n",
+						m->dev, strerror(errno));
+					return -1;
+				}
+				get_io_limits(fd, &l);
+				close(fd);
+
+				floor = max(floor, bucket_floor(&l, m->block_size));
+			}
+
+			bucket_size = min(max(floor, AUTO_BUCKET_DEFAULT * 512) / 512,
+					  AUTO_BUCKET_MAX);
+
+			printf("Set %s: bucket_size ", uuid_str);
+			print_size(stdout, bucket_size * 512ULL);
+			printf(" for all %u cache devices\n", n);
+		}
+
+		if (n > 1)
+			fprintf(stderr, "Set %s has %u cache devices; recent "
+				"kernels (5.10 on) only run sets with one\n",
+				uuid_str, n);
+
+		for (k = i; k < nr; k++) {
+			struct format_job *m = &jobs[k];
+
+			if (m->bdev || uuid_compare(m->set_uuid, j->set_uuid))
+				continue;
+
+			m->nr_in_set = n;
+			if (n > 1)
+				m->bucket_size = bucket_size;
+		}
+	}
+
+	return 0;
+}
+
+struct job_queue {
+	struct format_job	*jobs;
+	unsigned		nr;
+	unsigned		next;
+};
+
+static void *format_worker(void *arg)
+{
+	struct job_queue *q = arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add(&q->next, 1)) < q->nr)
+		q->jobs[i].ret = write_sb(&q->jobs[i]);
+
+	return NULL;
+}
+
+/*
+ * Format every job, up to nr_threads at a time.  With one thread this is
+ * the historical behaviour: output goes straight to stdout/stderr and we
+ * stop at the first failure.  Otherwise each device succeeds or fails on
+ * its own and we print the buffered output followed by a summary.
+ *
+ * Returns the number of devices that failed.
+ */
+static unsigned run_jobs(struct format_job *jobs, unsigned nr,
+			 unsigned nr_threads)
+{
+	struct job_queue q = { .jobs = jobs, .nr = nr };
+	pthread_t threads[nr];
+	unsigned i, failed = 0;
+
+	if (nr_threads <= 1 || nr <= 1) {
+		for (i = 0; i < nr; i++) {
+			jobs[i].out = stdout;
+			jobs[i].err = stderr;
+			if ((jobs[i].ret = write_sb(&jobs[i])))
+				return 1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		jobs[i].out = open_memstream(&jobs[i].out_buf, &jobs[i].out_len);
+		jobs[i].err = open_memstream(&jobs[i].err_buf, &jobs[i].err_len);
+		if (!jobs[i].out || !jobs[i].err) {
+			fprintf(stderr, "Could not allocate output buffers\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (nr_threads > nr)
+		nr_threads = nr;
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, format_worker, &q)) {
+			fprintf(stderr, "Could not start worker thread\n");
+			exit(EXIT_FAILURE);
+		}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nr; i++) {
+		fclose(jobs[i].out);
+		fclose(jobs[i].err);
+
+		printf("%s:\n", jobs[i].dev);
+		fwrite(jobs[i].out_buf, 1, jobs[i].out_len, stdout);
+		fflush(stdout);
+		fwrite(jobs[i].err_buf, 1, jobs[i].err_len, stderr);
+		putchar('\n');
+
+		free(jobs[i].out_buf);
+		free(jobs[i].err_buf);
 	}
 
-	fsync(fd);
+	printf("%-32s %-7s %-6s %10s %10s %10s %10s\n",
+	       "device", "type", "result",
+	       "probe ms", "discard ms", "write ms", "fsync ms");
+
+	for (i = 0; i < nr; i++) {
+		printf("%-32s %-7s %-6s %10.2f %10.2f %10.2f %10.2f\n",
+		       jobs[i].dev,
+		       jobs[i].bdev ? "backing" : "cache",
+		       jobs[i].ret ? "FAILED" : "ok",
+		       jobs[i].probe_ns / 1e6,
+		       jobs[i].trim_ns / 1e6,
+		       jobs[i].write_ns / 1e6,
+		       jobs[i].sync_ns / 1e6);
+
+		if (jobs[i].ret)
+			failed++;
+	}
+
+	printf("%u of %u devices formatted\n", nr - failed, nr);
+
+	return failed;
+}
+
+/*
+ * Sizes of the kernel's per cache device structures, used by --plan to
+ * estimate memory use (see drivers/md/bcache/bcache.h and super.c).
+ */
+#define KERNEL_BUCKET_SIZE	12	/* struct bucket */
+#define KERNEL_BUCKET_DISK_SIZE	3	/* struct bucket_disk, in prio buckets */
+#define KERNEL_PRIO_SET_SIZE	40	/* struct prio_set header */
+#define KERNEL_MCA_RESERVE	24	/* btree nodes always kept cached */
+#define KERNEL_BKEY_SIZE	24	/* extent key with one pointer */
+#define PLAN_EXTENT_SIZE	(64 << 10)
+
+static void human_size(char *buf, size_t len, uint64_t bytes)
+{
+	const char *units = "BKMGTPE";
+	double v = bytes;
+
+	while (v >= 1024 && units[1]) {
+		v /= 1024;
+		units++;
+	}
+
+	if (*units == 'B')
+		snprintf(buf, len, "%ju", bytes);
+	else
+		snprintf(buf, len, "%.*f%c", v < 10 ? 2 : v < 100 ? 1 : 0,
+			 v, *units);
+}
+
+/*
+ * --plan: show what formatting @dev as a cache would produce for each
+ * candidate bucket size, without writing anything.  On disk overhead is the
+ * superblock area, the journal the kernel sets up (nbuckets / 128, between 2
+ * and 256 buckets) and two generations of prio buckets; memory is the
+ * per-bucket state plus the allocator's fifos and heap, and the minimum
+ * btree node cache, whose nodes are one bucket each.
+ */
+static int plan_dev(const char *dev, unsigned block_size,
+		    unsigned bucket_size)
+{
+	char s[5][16];
+	uint64_t blocks;
+	unsigned size;
+	bool large = false;
+	int fd;
+
+	if ((fd = open(dev, O_RDONLY)) == -1) {
+		fprintf(stderr, "Can't open dev %s: %s\n", dev, strerror(errno));
+		return -1;
+	}
+
+	if (getblocks(fd, &blocks)) {
+		fprintf(stderr, "Can't get size of %s: %s\n",
+			dev, strerror(errno));
+		close(fd);
+		return -1;
+	}
 	close(fd);
+
+	human_size(s[0], sizeof(s[0]), blocks * 512);
+	human_size(s[1], sizeof(s[1]), block_size * 512);
+	printf("%s: %s, block size %s\n\n", dev, s[0], s[1]);
+
+	printf("  %-8s %12s %12s %10s %10s %10s %10s\n",
+	       "bucket", "nbuckets", "cache size", "on disk",
+	       "bucket mem", "btree mem", "total mem");
+
+	for (size = max(block_size, 16U); size <= BUCKET_SIZE_MAX; size <<= 1) {
+		struct cache_sb sb = { 0 };
+		uint64_t bucket_bytes = size * 512ULL, prios_per_bucket;
+		uint64_t prio_buckets, journal_buckets, meta, free;
+		uint64_t bucket_mem, btree_mem;
+
+		cache_sb_set_bucket_size(&sb, size);
+		cache_layout(&sb, blocks);
+		if (sb.nbuckets < MIN_BUCKETS)
+			break;
+
+		prios_per_bucket = (bucket_bytes - KERNEL_PRIO_SET_SIZE) /
+			KERNEL_BUCKET_DISK_SIZE;
+		prio_buckets = (sb.nbuckets + prios_per_bucket - 1) /
+			prios_per_bucket;
+		journal_buckets = min(max(sb.nbuckets >> 7, (uint64_t) 2),
+				      (uint64_t) SB_JOURNAL_BUCKETS);
+		meta = sb.first_bucket + journal_buckets + 2 * prio_buckets;
+
+		/* free_inc, RESERVE_MOVINGGC and RESERVE_NONE fifos and the heap */
+		free = roundup_pow_of_two(sb.nbuckets) >> 10;
+		bucket_mem = sb.nbuckets * KERNEL_BUCKET_SIZE +
+			free * (4 + 1 + 1 + 8) * sizeof(uint64_t) +
+			bucket_bytes;
+		btree_mem = KERNEL_MCA_RESERVE * bucket_bytes;
+
+		human_size(s[0], sizeof(s[0]), bucket_bytes);
+		human_size(s[1], sizeof(s[1]),
+			   (sb.nbuckets - meta) * bucket_bytes);
+		human_size(s[2], sizeof(s[2]), meta * bucket_bytes);
+		human_size(s[3], sizeof(s[3]), bucket_mem);
+		human_size(s[4], sizeof(s[4]), btree_mem);
+
+		large |= size > USHRT_MAX;
+		printf("%c %-8s %12ju %12s %10s %10s %10s ",
+		       size == bucket_size ? '*' : ' ',
+		       s[0], sb.nbuckets, s[1], s[2], s[3], s[4]);
+		human_size(s[0], sizeof(s[0]), bucket_mem + btree_mem);
+		printf("%10s\n", s[0]);
+	}
+
+	if (large)
+		printf("\n  buckets of 32M and up use the large_bucket "
+		       "superblock feature, which the kernel must support\n");
+
+	human_size(s[0], sizeof(s[0]),
+		   blocks * 512 / PLAN_EXTENT_SIZE * KERNEL_BKEY_SIZE);
+	printf("\n  btree index for a full cache: about %s "
+	       "(one %u byte key per %uk extent), cached as memory allows\n\n",
+	       s[0], KERNEL_BKEY_SIZE, PLAN_EXTENT_SIZE >> 10);
+
+	return 0;
 }
 
 static unsigned get_blocksize(const char *path)
@@ -335,17 +1437,295 @@ static unsigned get_blocksize(const char *path)
 	return statbuf.st_blksize / 512;
 }
 
+/*
+ * Manifest files describe any number of cache sets, one directive per line;
+ * '#' starts a comment:
+ *
+ *	set [key=value ...]
+ *	cache <device> [key=value ...]
+ *	backing <device> [key=value ...]
+ *
+ * A set line starts a new cache set, and the devices following it are
+ * formatted as its members (cache) or attached to it (backing).  Keys on a
+ * set line are defaults for its devices; command line options are defaults
+ * for everything.  Keys:
+ *
+ *	uuid=			set only; default is a fresh random uuid
+ *	bucket=, journal=, replacement=, discard, discard-device
+ *				set and cache lines
+ *	data-offset=, cache-mode=
+ *				set and backing lines
+ *	block=, wipe-bcache	anywhere
+ *	label=			device lines only
+ *
+ * The whole file is checked before anything is written.
+ */
+#define MANIFEST_JOBS	8
+
+enum manifest_role {
+	ROLE_SET,
+	ROLE_CACHE,
+	ROLE_BACKING,
+};
+
+static const char *manifest_path;
+static unsigned manifest_line;
+
+static void __attribute__((noreturn, format(printf, 1, 2)))
+manifest_err(const char *fmt, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s:%u: ", manifest_path, manifest_line);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+static void manifest_opt(struct format_job *j, char *opt,
+			 enum manifest_role role)
+{
+	char *v = strchr(opt, '='), msg[PATH_MAX + 64];
+	bool cache = role != ROLE_BACKING, backing = role != ROLE_CACHE;
+	ssize_t i;
+
+	if (v)
+		*v++ = '\0';
+
+	snprintf(msg, sizeof(msg), "%s:%u: %s",
+		 manifest_path, manifest_line, opt);
+
+	if (!strcmp(opt, "discard") && !v && cache) {
+		j->discard = true;
+	} else if (!strcmp(opt, "discard-device") && !v && cache) {
+		j->trim = true;
+	} else if (!strcmp(opt, "wipe-bcache") && !v) {
+		j->wipe_bcache = true;
+	} else if (!v) {
+		manifest_err("unknown option %s", opt);
+	} else if (!strcmp(opt, "uuid") && role == ROLE_SET) {
+		if (uuid_parse(v, j->set_uuid))
+			manifest_err("bad uuid %s", v);
+	} else if (!strcmp(opt, "bucket") && cache) {
+		j->bucket_size = !strcmp(v, "auto") ? 0 :
+			hatoi_validate(v, msg, BUCKET_SIZE_MAX);
+		j->bucket_given = j->bucket_size;
+	} else if (!strcmp(opt, "journal") && cache) {
+		if (!(j->journal_size = hatoi(v)))
+			manifest_err("bad journal size %s", v);
+	} else if (!strcmp(opt, "block")) {
+		j->block_size = hatoi_validate(v, msg, USHRT_MAX);
+	} else if (!strcmp(opt, "replacement") && cache) {
+		if ((i = read_string_list(v, cache_replacement_policies)) < 0)
+			manifest_err("bad replacement policy %s", v);
+		j->cache_replacement_policy = i;
+	} else if (!strcmp(opt, "data-offset") && backing) {
+		j->data_offset = atoll(v);
+		if (j->data_offset < BDEV_DATA_START_DEFAULT)
+			manifest_err("bad data offset; minimum %d sectors",
+				     BDEV_DATA_START_DEFAULT);
+	} else if (!strcmp(opt, "cache-mode") && backing) {
+		if ((i = read_string_list(v, cache_modes)) < 0)
+			manifest_err("bad cache mode %s", v);
+		j->cache_mode = i;
+	} else if (!strcmp(opt, "label") && role != ROLE_SET) {
+		if (strlen(v) > SB_LABEL_SIZE)
+			manifest_err("label longer than %u bytes", SB_LABEL_SIZE);
+		memset(j->label, 0, SB_LABEL_SIZE);
+		memcpy(j->label, v, strlen(v));
+	} else {
+		manifest_err("option %s not valid on this line", opt);
+	}
+}
+
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+	if (S_ISBLK(a->st_mode) && S_ISBLK(b->st_mode))
+		return a->st_rdev == b->st_rdev;
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+/*
+ * Members of a cache set must agree on the block size; if it isn't given,
+ * use the largest one of any device in the set, as on the command line.
+ * Backing devices can't have a smaller block size than their cache.
+ */
+static void manifest_finish_set(struct format_job *jobs, unsigned nr,
+				bool block_size_given)
+{
+	unsigned i, block_size = 0, cache_block_size = 0;
+
+	if (!nr)
+		manifest_err("empty cache set");
+
+	for (i = 0; i < nr; i++)
+		if (!jobs[i].block_size)
+			block_size = max(block_size,
+					 get_blocksize(jobs[i].dev));
+		else if (!block_size_given)
+			block_size = max(block_size, jobs[i].block_size);
+
+	for (i = 0; i < nr; i++) {
+		struct format_job *j = &jobs[i];
+
+		if (!j->block_size)
+			j->block_size = block_size;
+
+		if (j->bdev)
+			continue;
+
+		if (cache_block_size && j->block_size != cache_block_size)
+			manifest_err("cache devices in a set must have the "
+				     "same block size (%s)", j->dev);
+		cache_block_size = j->block_size;
+
+		if (j->bucket_size && j->bucket_size < j->block_size)
+			manifest_err("bucket size cannot be smaller than "
+				     "block size (%s)", j->dev);
+	}
+
+	for (i = 0; i < nr; i++)
+		if (jobs[i].bdev && jobs[i].block_size < cache_block_size)
+			manifest_err("backing device %s has a smaller block "
+				     "size than its cache", jobs[i].dev);
+}
+
+/* Returns the number of jobs, stored in *jobs_ret */
+static unsigned parse_manifest(const char *path,
+			       const struct format_job *defaults,
+			       struct format_job **jobs_ret)
+{
+	struct format_job set, *jobs = NULL;
+	struct stat *st = NULL;
+	unsigned nr = 0, set_start = 0, nr_sets = 0, i;
+	bool in_set = false, set_block_size = false;
+	char *buf = NULL, *tok, *save;
+	size_t n = 0;
+	FILE *f;
+
+	manifest_path = path;
+
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "Can't open manifest %s: %s\n",
+			path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&buf, &n, f) != -1) {
+		enum manifest_role role;
+		struct format_job *j;
+
+		manifest_line++;
+
+		if ((tok = strchr(buf, '#')))
+			*tok = '\0';
+
+		if (!(tok = strtok_r(buf, " \t\n", &save)))
+			continue;
+
+		if (!strcmp(tok, "set")) {
+			if (in_set)
+				manifest_finish_set(jobs + set_start,
+						    nr - set_start,
+						    set_block_size);
+
+			set = *defaults;
+			uuid_generate(set.set_uuid);
+
+			while ((tok = strtok_r(NULL, " \t\n", &save)))
+				manifest_opt(&set, tok, ROLE_SET);
+
+			set_block_size = set.block_size;
+			set_start = nr;
+			in_set = true;
+			nr_sets++;
+			continue;
+		}
+
+		if (!strcmp(tok, "cache"))
+			role = ROLE_CACHE;
+		else if (!strcmp(tok, "backing"))
+			role = ROLE_BACKING;
+		else
+			manifest_err("unknown directive %s", tok);
+
+		if (!in_set)
+			manifest_err("%s before the first set line", tok);
+
+		if (!(tok = strtok_r(NULL, " \t\n", &save)))
+			manifest_err("missing device");
+
+		jobs = realloc(jobs, (nr + 1) * sizeof(*jobs));
+		st = realloc(st, (nr + 1) * sizeof(*st));
+		if (!jobs || !st) {
+			fprintf(stderr, "Could not allocate jobs\n");
+			exit(EXIT_FAILURE);
+		}
+
+		j = &jobs[nr];
+		*j = set;
+		j->bdev = role == ROLE_BACKING;
+		if (!(j->dev = strdup(tok))) {
+			fprintf(stderr, "Could not allocate jobs\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (stat(j->dev, &st[nr]))
+			manifest_err("%s: %s", j->dev, strerror(errno));
+
+		for (i = 0; i < nr; i++)
+			if (same_file(&st[i], &st[nr]))
+				manifest_err("%s is already used as %s",
+					     j->dev, jobs[i].dev);
+
+		while ((tok = strtok_r(NULL, " \t\n", &save)))
+			manifest_opt(j, tok, role);
+
+		nr++;
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "Error reading manifest %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!in_set)
+		manifest_err("no cache sets");
+
+	manifest_finish_set(jobs + set_start, nr - set_start, set_block_size);
+
+	printf("%s: %u cache sets, %u devices\n", path, nr_sets, nr);
+
+	free(buf);
+	free(st);
+	fclose(f);
+
+	*jobs_ret = jobs;
+	return nr;
+}
+
 int main(int argc, char **argv)
 {
 	int c, bdev = -1;
 	unsigned i, ncache_devices = 0, nbacking_devices = 0;
+	unsigned njobs;
+	int nr_threads = -1;
+	struct format_job *jobs, defaults;
+	char *manifest = NULL, *label = NULL;
 	char *cache_devices[argc];
 	char *backing_devices[argc];
 
 	unsigned block_size = 0, bucket_size = 1024;
-	int writeback = 0, discard = 0, wipe_bcache = 0;
+	int writeback = 0, discard = 0, trim = 0, bucket_sweep = 0;
+	int wipe_bcache = 0, plan = 0;
 	unsigned cache_replacement_policy = 0;
-	uint64_t data_offset = BDEV_DATA_START_DEFAULT;
+	uint64_t data_offset = 0;	/* aligned to the device's stripe */
+	uint64_t journal_size = 0;
+	uint64_t emulate_zone_size = 0, emulate_zone_capacity = 0;
+	bool bucket_given = false;
+	char *end;
 	uuid_t set_uuid;
 
 	uuid_generate(set_uuid);
@@ -358,17 +1738,25 @@ int main(int argc, char **argv)
 		{ "writeback",		0, &writeback,	1 },
 		{ "wipe-bcache",	0, &wipe_bcache,	1 },
 		{ "discard",		0, &discard,	1 },
+		{ "discard-device",	0, &trim,	1 },
+		{ "bucket-sweep",	0, &bucket_sweep, 1 },
+		{ "plan",		0, &plan,	1 },
+		{ "journal-size",	1, NULL,	'J' },
+		{ "emulate-zones",	1, NULL,	'Z' },
 		{ "cache_replacement_policy", 1, NULL, 'p' },
 		{ "cache-replacement-policy", 1, NULL, 'p' },
 		{ "data_offset",	1, NULL,	'o' },
 		{ "data-offset",	1, NULL,	'o' },
 		{ "cset-uuid",		1, NULL,	'u' },
+		{ "jobs",		1, NULL,	'j' },
+		{ "label",		1, NULL,	'l' },
+		{ "manifest",		1, NULL,	'm' },
 		{ "help",		0, NULL,	'h' },
 		{ NULL,			0, NULL,	0 },
 	};
 
 	while ((c = getopt_long(argc, argv,
-				"-hCBUo:w:b:",
+				"-hCBUo:w:b:j:l:m:",
 				opts, NULL)) != -1)
 		switch (c) {
 		case 'C':
@@ -378,10 +1766,30 @@ int main(int argc, char **argv)
 			bdev = 1;
 			break;
 		case 'b':
-			bucket_size = hatoi_validate(optarg, "bucket size");
+			bucket_size = !strcmp(optarg, "auto")
+				? 0
+				: hatoi_validate(optarg, "bucket size",
+						 BUCKET_SIZE_MAX);
+			bucket_given = bucket_size;
+			break;
+		case 'Z':
+			emulate_zone_size = hatoi(optarg) / 512;
+			if ((end = strchr(optarg, ',')))
+				emulate_zone_capacity = hatoi(end + 1) / 512;
+			if (!emulate_zone_size) {
+				fprintf(stderr, "Bad zone size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'w':
-			block_size = hatoi_validate(optarg, "block size");
+			block_size = hatoi_validate(optarg, "block size",
+						    USHRT_MAX);
+			break;
+		case 'J':
+			if (!(journal_size = hatoi(optarg))) {
+				fprintf(stderr, "Bad journal size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
 			break;
 #if 0
 		case 'U':
@@ -409,6 +1817,20 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'l':
+			if (strlen(optarg) > SB_LABEL_SIZE) {
+				fprintf(stderr, "Label longer than %u bytes\n",
+					SB_LABEL_SIZE);
+				exit(EXIT_FAILURE);
+			}
+			label = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
 		case 'h':
 			usage();
 			break;
@@ -425,12 +1847,57 @@ int main(int argc, char **argv)
 			break;
 		}
 
+	memset(&defaults, 0, sizeof(defaults));
+	defaults.block_size		= block_size;
+	defaults.bucket_size		= bucket_size;
+	defaults.cache_mode		= writeback
+		? CACHE_MODE_WRITEBACK
+		: CACHE_MODE_WRITETHROUGH;
+	defaults.discard		= discard;
+	defaults.trim			= trim;
+	defaults.bucket_sweep		= bucket_sweep;
+	defaults.wipe_bcache		= wipe_bcache;
+	defaults.cache_replacement_policy = cache_replacement_policy;
+	defaults.data_offset		= data_offset;
+	defaults.journal_size		= journal_size;
+	defaults.bucket_given		= bucket_given;
+	defaults.emulate_zone_size	= emulate_zone_size;
+	defaults.emulate_zone_capacity	= emulate_zone_capacity;
+	memcpy(defaults.set_uuid, set_uuid, sizeof(uuid_t));
+	if (label)
+		memcpy(defaults.label, label, strlen(label));
+
+	if (manifest) {
+		if (ncache_devices || nbacking_devices) {
+			fprintf(stderr, "Devices can't be given along with "
+				"a manifest\n");
+			exit(EXIT_FAILURE);
+		}
+
+		njobs = parse_manifest(manifest, &defaults, &jobs);
+
+		if (plan) {
+			int ret = 0;
+
+			for (i = 0; i < njobs; i++)
+				if (!jobs[i].bdev)
+					ret |= plan_dev(jobs[i].dev,
+							jobs[i].block_size,
+							jobs[i].bucket_size);
+			return ret ? EXIT_FAILURE : 0;
+		}
+
+		if (nr_threads < 0)
+			nr_threads = MANIFEST_JOBS;
+		goto run;
+	}
+
 	if (!ncache_devices && !nbacking_devices) {
 		fprintf(stderr, "Please supply a device\n");
 		usage();
 	}
 
-	if (bucket_size < block_size) {
+	if (bucket_size && bucket_size < block_size) {
 		fprintf(stderr, "Bucket size cannot be smaller than block size\n");
 		exit(EXIT_FAILURE);
 	}
@@ -445,17 +1912,41 @@ int main(int argc, char **argv)
 					 get_blocksize(backing_devices[i]));
 	}
 
-	for (i = 0; i < ncache_devices; i++)
-		write_sb(cache_devices[i], block_size, bucket_size,
-			 writeback, discard, wipe_bcache,
-			 cache_replacement_policy,
-			 data_offset, set_uuid, false);
+	if (plan) {
+		int ret = 0;
 
-	for (i = 0; i < nbacking_devices; i++)
-		write_sb(backing_devices[i], block_size, bucket_size,
-			 writeback, discard, wipe_bcache,
-			 cache_replacement_policy,
-			 data_offset, set_uuid, true);
+		for (i = 0; i < ncache_devices; i++)
+			ret |= plan_dev(cache_devices[i], block_size,
+					bucket_size);
+		return ret ? EXIT_FAILURE : 0;
+	}
 
-	return 0;
+	njobs = ncache_devices + nbacking_devices;
+	jobs = calloc(njobs, sizeof(*jobs));
+	if (!jobs) {
+		fprintf(stderr, "Could not allocate jobs\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		struct format_job *j = &jobs[i];
+
+		*j = defaults;
+		j->block_size = block_size;
+		j->bdev = i >= ncache_devices;
+		j->dev = j->bdev
+			? backing_devices[i - ncache_devices]
+			: cache_devices[i];
+	}
+
+	if (nr_threads < 0)
+		nr_threads = 1;
+run:
+	if (number_set_members(jobs, njobs))
+		exit(EXIT_FAILURE);
+
+	if (!nr_threads)
+		nr_threads = njobs;
+
+	return run_jobs(jobs, njobs, nr_threads) ? EXIT_FAILURE : 0;
 }
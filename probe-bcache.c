@@ -6,34 +6,422 @@
 
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <blkid.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
 #include "bcache.h"
+#include "uring.h"
+
+#define BATCH_THREADS	32
+#define BATCH_QD	256
+#define PROBE_CACHE_DIR	"/run/bcache/probe"
+
+struct probe {
+	const char	*dev;
+	int		fd;
+	bool		done;
+	/* everything up to the end of the superblock, in one read */
+	union {
+		unsigned char		buf[SB_START + sizeof(struct cache_sb)];
+		struct {
+			unsigned char	pad[SB_START];
+			struct cache_sb	sb;
+		};
+	};
+	struct iovec	iov;
+};
+
+static bool udev, batch, do_register;
+static const char *cache_dir;
+
+/*
+ * bail if blkid finds anything but bcache (a filesystem or partition table
+ * that happens to leave our superblock intact); recent libblkid recognizes
+ * bcache itself
+ */
+static bool blkid_other(int fd)
+{
+	const char *type;
+	blkid_probe pr;
+	bool ret = true;
+
+	if (!(pr = blkid_new_probe()))
+		return true;
+	/* probe partitions too */
+	if (!blkid_probe_set_device(pr, fd, 0, 0) &&
+	    !blkid_probe_enable_partitions(pr, true))
+		ret = !blkid_do_probe(pr) &&
+			(blkid_probe_lookup_value(pr, "TYPE", &type, NULL) ||
+			 strcmp(type, "bcache"));
+	blkid_free_probe(pr);
+	return ret;
+}
+
+/*
+ * Optional cache of blkid verdicts, one file per device in cache_dir, so
+ * repeated udev events for an unchanged device skip the blkid probe.  An
+ * entry is keyed by device number and size and holds a crc64 of everything
+ * we read: the first SB_START + sizeof(struct cache_sb) bytes, about 6k.
+ * Rewriting the bcache superblock or anything before it (partition table,
+ * most filesystem superblocks) invalidates it; signatures further in (btrfs
+ * at 64k, md 1.0 metadata and the backup GPT at the end) don't.  So the
+ * cache is only a shortcut for reporting, never for registering: with -r
+ * blkid always runs.
+ */
+struct cache_entry {
+	uint64_t	size;
+	uint64_t	hash;
+	int		other;
+};
+
+static bool cache_path(struct probe *p, char *path, size_t len,
+		       struct cache_entry *e)
+{
+	struct stat statbuf;
+
+	if (!cache_dir || do_register || fstat(p->fd, &statbuf))
+		return false;
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		if (ioctl(p->fd, BLKGETSIZE64, &e->size))
+			return false;
+		snprintf(path, len, "%s/%u:%u", cache_dir,
+			 major(statbuf.st_rdev), minor(statbuf.st_rdev));
+	} else {
+		e->size = statbuf.st_size;
+		snprintf(path, len, "%s/%ju-%ju", cache_dir,
+			 (uintmax_t) statbuf.st_dev,
+			 (uintmax_t) statbuf.st_ino);
+	}
+
+	e->hash = crc64(p->buf, sizeof(p->buf));
+	return true;
+}
+
+static bool cache_lookup(const char *path, const struct cache_entry *e,
+			 bool *other)
+{
+	struct cache_entry c;
+	FILE *f = fopen(path, "r");
+	bool ret;
+
+	if (!f)
+		return false;
+
+	ret = fscanf(f, "%" SCNu64 " %" SCNx64 " %d",
+		     &c.size, &c.hash, &c.other) == 3 &&
+		c.size == e->size &&
+		c.hash == e->hash;
+	fclose(f);
+
+	if (ret)
+		*other = c.other;
+	return ret;
+}
+
+/*
+ * mkdir -p: cache_dir is usually somewhere under /run, which starts out
+ * empty on every boot
+ */
+static void mkdir_parents(const char *dir)
+{
+	char path[PATH_MAX], *s;
+
+	if (snprintf(path, sizeof(path), "%s", dir) >= sizeof(path))
+		return;
+
+	for (s = path + 1; (s = strchr(s, '/')); *s++ = '/') {
+		*s = '\0';
+		mkdir(path, 0755);
+	}
+	mkdir(path, 0755);
+}
+
+/* Written to a temporary file and renamed, so readers never see half */
+static void cache_store(const char *path, const struct cache_entry *e)
+{
+	char tmp[PATH_MAX + 16];
+	FILE *f;
+
+	mkdir_parents(cache_dir);
+
+	snprintf(tmp, sizeof(tmp), "%s.%u", path, (unsigned) getpid());
+	if (!(f = fopen(tmp, "w")))
+		return;
+
+	fprintf(f, "%" PRIu64 " %016" PRIx64 " %d\n",
+		e->size, e->hash, e->other);
+
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
+}
+
+static bool blkid_other_cached(struct probe *p)
+{
+	char path[PATH_MAX];
+	struct cache_entry e;
+	bool other;
+
+	if (!cache_path(p, path, sizeof(path), &e))
+		return blkid_other(p->fd);
+
+	if (cache_lookup(path, &e, &other))
+		return other;
+
+	e.other = other = blkid_other(p->fd);
+	cache_store(path, &e);
+	return other;
+}
+
+/*
+ * Devices are only opened right before their superblock is read and closed
+ * as soon as they're checked, so batch mode never holds more than a queue
+ * or thread pool's worth of fds, however many devices it's given.
+ */
+static bool probe_open(struct probe *p)
+{
+	if (p->fd >= 0)
+		return true;
+
+	p->fd = open(p->dev, O_RDONLY);
+	if (p->fd < 0) {
+		/* udev runs us on every block device; not worth a log line */
+		if (!udev)
+			fprintf(stderr, "Can't open %s: %s\n",
+				p->dev, strerror(errno));
+		p->done = true;
+		return false;
+	}
+	return true;
+}
+
+static void probe_close(struct probe *p)
+{
+	close(p->fd);
+	p->fd = -1;
+	p->done = true;
+}
+
+/*
+ * Called once p->buf has been read.  Almost nothing we're run on is bcache,
+ * and the superblock checks tell us that; only run the (much slower) full
+ * blkid probe for devices that pass them.
+ *
+ * In udev mode we also export what the rules need beyond blkid's ID_FS_*.
+ * With -r, register the device right away, saving scripts a separate
+ * bcache-register process (not the udev rules: IMPORT must stay side
+ * effect free).
+ */
+static void probe_finish(struct probe *p)
+{
+	char uuid[40], set_uuid[40];
+	int ret = 0;
+
+	if (!cache_sb_valid(&p->sb) || blkid_other_cached(p))
+		goto out;
+
+	uuid_unparse(p->sb.uuid, uuid);
+	uuid_unparse(p->sb.set_uuid, set_uuid);
+
+	if (do_register) {
+		ret = bcache_register(BCACHE_REGISTER_PATH, p->dev);
+		if (ret && !udev)
+			fprintf(stderr, "Error registering %s with bcache: %s\n",
+				p->dev, strerror(-ret));
+	}
+
+	flockfile(stdout);
+	if (udev) {
+		printf("ID_FS_UUID=%s\n"
+		       "ID_FS_UUID_ENC=%s\n"
+		       "ID_FS_TYPE=bcache\n"
+		       "BCACHE_SET_UUID=%s\n"
+		       "BCACHE_ROLE=%s\n",
+		       uuid, uuid, set_uuid,
+		       SB_IS_BDEV(&p->sb) ? "backing" : "cache");
+		if (do_register)
+			printf("BCACHE_REGISTERED=%u\n", !ret);
+	} else if (batch) {
+		printf("%s: UUID=\"%s\" TYPE=\"bcache\"\n",
+		       p->dev, uuid);
+	} else {
+		printf("%s: UUID=\"\" TYPE=\"bcache\"\n", uuid);
+	}
+	fflush(stdout);
+	funlockfile(stdout);
+out:
+	probe_close(p);
+}
+
+static void probe_sync(struct probe *p)
+{
+	if (p->done || !probe_open(p))
+		return;
+
+	if (pread(p->fd, p->buf, sizeof(p->buf), 0) == sizeof(p->buf))
+		probe_finish(p);
+	else
+		probe_close(p);
+}
+
+/*
+ * At most half the fds we're allowed, leaving the rest for stdio, the ring
+ * and libblkid
+ */
+static unsigned fd_budget(unsigned want)
+{
+	struct rlimit r;
+
+	if (getrlimit(RLIMIT_NOFILE, &r) || r.rlim_cur == RLIM_INFINITY ||
+	    r.rlim_cur / 2 >= want)
+		return want;
+
+	return r.rlim_cur / 2 ?: 1;
+}
+
+/*
+ * Batch mode, io_uring: keep up to BATCH_QD superblock reads in flight and
+ * check each one as it completes, so scanning N devices costs about one
+ * device's latency instead of N.  On error, devices not yet done are left
+ * for probe_threads().
+ */
+static int probe_uring(struct probe *probes, unsigned nr)
+{
+	struct uring ring;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	unsigned next = 0, inflight = 0;
+	unsigned qd = fd_budget(nr < BATCH_QD ? nr : BATCH_QD);
+	int ret;
+
+	if ((ret = uring_init(&ring, qd)))
+		return ret;
+
+	while (next < nr || inflight) {
+		while (next < nr && inflight < qd) {
+			struct probe *p = &probes[next];
+
+			if (!probe_open(p)) {
+				next++;
+				continue;
+			}
+
+			if (!(sqe = uring_get_sqe(&ring)))
+				break;
+
+			p->iov.iov_base	= p->buf;
+			p->iov.iov_len	= sizeof(p->buf);
+			uring_prep_rw(sqe, IORING_OP_READV, p->fd, &p->iov, 1,
+				      0, next);
+			next++;
+			inflight++;
+		}
+
+		/* everything left failed to open */
+		if (!inflight)
+			break;
+
+		if ((ret = uring_submit(&ring, 1)) < 0) {
+			uring_exit(&ring);
+			return ret;
+		}
+
+		while ((cqe = uring_peek_cqe(&ring))) {
+			struct probe *p = &probes[cqe->user_data];
+
+			if (cqe->res == sizeof(p->buf))
+				probe_finish(p);
+			else
+				probe_close(p);
+
+			uring_cqe_seen(&ring);
+			inflight--;
+		}
+	}
+
+	uring_exit(&ring);
+	return 0;
+}
+
+struct probe_pool {
+	struct probe	*probes;
+	unsigned	nr;
+	unsigned	next;
+};
+
+static void *probe_worker(void *arg)
+{
+	struct probe_pool *pool = arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->nr)
+		probe_sync(&pool->probes[i]);
+
+	return NULL;
+}
+
+/* Batch mode without io_uring: blocking reads from a pool of threads */
+static void probe_threads(struct probe *probes, unsigned nr,
+			  unsigned nr_threads)
+{
+	struct probe_pool pool = { .probes = probes, .nr = nr };
+	pthread_t threads[nr_threads];
+	unsigned i, started = 0;
+
+	for (i = 0; i < nr_threads && i < nr; i++)
+		if (!pthread_create(&threads[i], NULL, probe_worker, &pool))
+			started++;
+
+	/* whatever the threads didn't get to */
+	probe_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: probe-bcache [options] device...\n"
+		"	-o udev		print udev properties\n"
+		"	-b		batch mode: probe all devices at once,\n"
+		"			printing each bcache device as found\n"
+		"	-j threads	threads to use in batch mode if io_uring\n"
+		"			isn't available (default %u)\n"
+		"	-c dir		cache results in dir (e.g. %s),\n"
+		"			created if missing; ignored with -r\n"
+		"	-r		register bcache devices with the kernel\n",
+		BATCH_THREADS, PROBE_CACHE_DIR);
+}
 
 int main(int argc, char **argv)
 {
-	bool udev = false;
+	unsigned nr = 0, nr_threads = BATCH_THREADS;
+	struct probe *probes;
 	int i, o;
 	extern char *optarg;
-	struct cache_sb sb;
-	char uuid[40];
-	blkid_probe pr;
 
-	while ((o = getopt(argc, argv, "o:")) != EOF)
+	while ((o = getopt(argc, argv, "o:bj:c:r")) != EOF)
 		switch (o) {
 		case 'o':
 			if (strcmp("udev", optarg)) {
@@ -42,46 +430,49 @@ int main(int argc, char **argv)
 			}
 			udev = true;
 			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'r':
+			do_register = true;
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
 		}
 
+	if (udev && batch) {
+		fprintf(stderr, "udev output is for single devices, "
+			"can't be used in batch mode\n");
+		exit(EXIT_FAILURE);
+	}
 
 	argv += optind;
 	argc -= optind;
 
-	for (i = 0; i < argc; i++) {
-		int fd = open(argv[i], O_RDONLY);
-		if (fd == -1)
-			continue;
-
-		if (!(pr = blkid_new_probe()))
-			continue;
-		if (blkid_probe_set_device(pr, fd, 0, 0))
-			continue;
-		/* probe partitions too */
-		if (blkid_probe_enable_partitions(pr, true))
-			continue;
-		/* bail if anything was found
-		 * probe-bcache isn't needed once blkid recognizes bcache */
-		if (!blkid_do_probe(pr)) {
-			continue;
-		}
-
-		if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb))
-			continue;
-
-		if (memcmp(sb.magic, bcache_magic, 16))
-			continue;
+	probes = calloc(argc, sizeof(*probes));
+	if (!probes) {
+		fprintf(stderr, "Could not allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
 
-		uuid_unparse(sb.uuid, uuid);
+	for (i = 0; i < argc; i++) {
+		probes[i].dev	= argv[i];
+		probes[i].fd	= -1;
 
-		if (udev)
-			printf("ID_FS_UUID=%s\n"
-			       "ID_FS_UUID_ENC=%s\n"
-			       "ID_FS_TYPE=bcache\n",
-			       uuid, uuid);
-		else
-			printf("%s: UUID=\"\" TYPE=\"bcache\"\n", uuid);
+		if (!batch)
+			probe_sync(&probes[i]);
 	}
 
+	nr = argc;
+	if (batch && nr && probe_uring(probes, nr))
+		probe_threads(probes, nr, fd_budget(nr_threads ?: 1));
+
 	return 0;
 }
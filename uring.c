@@ -0,0 +1,145 @@
+/*
+ * Minimal io_uring wrapper, so the tools don't need liburing
+ *
+ * GPLv2
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+			     MAP_SHARED|MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ|PROT_WRITE,
+				     MAP_SHARED|MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head	= ring->sq_ring + p.sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask	= ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array	= ring->sq_ring + p.sq_off.array;
+	ring->sqe_tail	= *ring->sq_tail;
+
+	ring->cq_head	= ring->cq_ring + p.cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask	= ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes	= ring->cq_ring + p.cq_off.cqes;
+
+	return 0;
+err:
+	ret = -errno;
+	if (ring->sq_ring == MAP_FAILED)
+		ring->sq_ring = NULL;
+	uring_exit(ring);
+	return ret;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned mask = *ring->sq_mask;
+
+	if (ring->sqe_tail - load_acquire(ring->sq_head) > mask)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sqe_tail & mask];
+	ring->sq_array[ring->sqe_tail & mask] = ring->sqe_tail & mask;
+	ring->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	unsigned submit = ring->sqe_tail - *ring->sq_tail;
+	int ret;
+
+	store_release(ring->sq_tail, ring->sqe_tail);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+			      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == load_acquire(ring->cq_tail))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	store_release(ring->cq_head, *ring->cq_head + 1);
+}
@@ -0,0 +1,57 @@
+/*
+ * Minimal io_uring wrapper, so the tools don't need liburing
+ *
+ * GPLv2
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+	int			fd;
+
+	unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe	*sqes;
+	unsigned		sqe_tail;	/* sqes handed out, not submitted */
+
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/* Returns -errno if the kernel doesn't do io_uring (or won't let us) */
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+
+/* A zeroed sqe, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/*
+ * Submit every sqe handed out so far and wait for at least @wait_nr
+ * completions; returns the number submitted or -errno.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+/* The oldest unconsumed completion, or NULL */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+				 void *buf, unsigned len, uint64_t offset,
+				 uint64_t user_data)
+{
+	sqe->opcode	= op;
+	sqe->fd		= fd;
+	sqe->addr	= (unsigned long) buf;
+	sqe->len	= len;
+	sqe->off	= offset;
+	sqe->user_data	= user_data;
+}
+
+#endif